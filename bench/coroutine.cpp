@@ -0,0 +1,74 @@
+// Cycles for one round robin pass over the coroutine pool, with tasks that
+// resume on every pass and with tasks that wait on an awaiter that never
+// becomes ready: a predicate checked on every pass, a long delay, and a
+// predicate bound to the temperature update, which is raised on one pass
+// in 25 like at the temperature rate. Results are printed over USB every
+// few seconds.
+#include <cstdio>
+#include <pico/stdlib.h>
+#include "control/impl/coroutine.hpp"
+#include "control/impl/profiler.hpp"
+
+constexpr u32 PASSES = 1000;
+
+static volatile u32 sink;
+
+[[noreturn]] void panic(Error error) {
+    printf("Panic with error %d\n", static_cast<int>(error));
+    while (true) tight_loop_contents();
+}
+
+static Coroutine running_task() {
+    while (true) {
+        sink = sink + 1;
+        co_await next_cycle;
+    }
+}
+
+static Coroutine waiting_task() {
+    co_await predicate([] { return false; });
+}
+
+static Coroutine delay_task() {
+    co_await delay_ms(1000 * 60 * 20);
+}
+
+static Coroutine temp_task() {
+    co_await predicate([] { return false; }, Coroutine::TEMP_UPDATE);
+}
+
+static u32 measure(usize tasks, Coroutine (*task)()) {
+    for (usize i = 0; i < tasks; i++) {
+        task();
+    }
+    Coroutine::resume_all(); // Runs the tasks up to their first suspension
+
+    u32 start = profiler::cycles();
+    for (u32 i = 0; i < PASSES; i++) {
+        if (i % 25 == 0) Coroutine::wake(Coroutine::TEMP_UPDATE);
+        Coroutine::resume_all();
+    }
+    u32 cycles = profiler::cycles_since(start) / PASSES;
+    Coroutine::destroy_all();
+    return cycles;
+}
+
+int main() {
+    stdio_init_all();
+    profiler::init();
+
+    while (true) {
+        printf("Cycles per pass   running  waiting    delay  temp\n");
+        for (usize tasks = 0; tasks <= Coroutine::FRAME_COUNT; tasks++) {
+            u32 running = measure(tasks, running_task);
+            u32 waiting = measure(tasks, waiting_task);
+            u32 delay = measure(tasks, delay_task);
+            u32 temp = measure(tasks, temp_task);
+            printf("%u tasks          %7u %8u %8u %5u\n", static_cast<unsigned>(tasks),
+                   static_cast<unsigned>(running), static_cast<unsigned>(waiting),
+                   static_cast<unsigned>(delay), static_cast<unsigned>(temp));
+        }
+        printf("\n");
+        sleep_ms(5000);
+    }
+}
@@ -0,0 +1,145 @@
+// Compares the cost of the filters and the PID controller in soft float and
+// in fixed point on the target, and how far the fixed point outputs drift
+// from the float ones. Results are printed over USB every few seconds.
+// The PID runs back to back here, its derivative term saturates on the tiny
+// time steps so only its cycle count is meaningful.
+// The pump's flow per click curve is compared as the polynomial and as the
+// interpolated table the firmware uses.
+#include <cmath>
+#include <cstdio>
+#include <pico/stdlib.h>
+#include "control/impl/kalman_filter.hpp"
+#include "control/impl/pid.hpp"
+#include "control/impl/profiler.hpp"
+#include "control/pump.hpp"
+#include "control/tuning.hpp"
+
+constexpr usize SAMPLES = 1000;
+
+static float inputs[SAMPLES];
+static volatile float sink;
+
+struct Result {
+    u32 kalman_cycles;
+    u32 pid_cycles;
+    float outputs[SAMPLES];
+};
+
+// Noisy step from room to brew temperature, like a warm-up
+static void generate_inputs() {
+    u32 seed = 1;
+    for (usize i = 0; i < SAMPLES; i++) {
+        seed = seed * 1103515245 + 12345;
+        float noise = static_cast<float>((seed >> 16) & 0xFF) / 255.f - 0.5f;
+        inputs[i] = 93.f - 70.f * expf(-static_cast<float>(i) / 200.f) + noise;
+    }
+}
+
+template<typename T>
+static void run(Result& result) {
+    SimpleKalmanFilter<T> filter(tuning::TEMP_FILTER.err_measure, tuning::TEMP_FILTER.err_estimate,
+                                 tuning::TEMP_FILTER.q);
+    PID<T> pid(tuning::HEATER_PID.kP, tuning::HEATER_PID.kI, tuning::HEATER_PID.kD, 0, 1);
+    pid.set_target(93.f);
+
+    // Conversions are done up front so only the updates get counted
+    static T converted[SAMPLES];
+    static T filtered[SAMPLES];
+    for (usize i = 0; i < SAMPLES; i++) {
+        converted[i] = inputs[i];
+    }
+    filter.reset(converted[0]);
+    pid.reset(converted[0]);
+
+    u32 start = profiler::cycles();
+    for (usize i = 0; i < SAMPLES; i++) {
+        filtered[i] = filter.update(converted[i]);
+    }
+    result.kalman_cycles = profiler::cycles_since(start) / SAMPLES;
+
+    T output = 0;
+    start = profiler::cycles();
+    for (usize i = 0; i < SAMPLES; i++) {
+        output += pid.update(filtered[i]);
+    }
+    result.pid_cycles = profiler::cycles_since(start) / SAMPLES;
+    sink = static_cast<float>(output);
+
+    for (usize i = 0; i < SAMPLES; i++) {
+        result.outputs[i] = static_cast<float>(filtered[i]);
+    }
+}
+
+struct PumpModelResult {
+    u32 polynomial_cycles;
+    u32 table_cycles;
+    float max_error;
+};
+
+// Pressures sweeping the table range, read from RAM so the loop can't be
+// folded at compile time
+static float pressures[SAMPLES];
+
+static void run_pump_model(PumpModelResult& result) {
+    for (usize i = 0; i < SAMPLES; i++) {
+        pressures[i] = 14.f * static_cast<float>(i) / SAMPLES;
+    }
+
+    float sum = 0;
+    u32 start = profiler::cycles();
+    for (usize i = 0; i < SAMPLES; i++) {
+        sum += get_flow_per_click_datasheet(pressures[i]);
+    }
+    result.polynomial_cycles = profiler::cycles_since(start) / SAMPLES;
+
+    start = profiler::cycles();
+    for (usize i = 0; i < SAMPLES; i++) {
+        sum += flow_per_click_table(pressures[i]);
+    }
+    result.table_cycles = profiler::cycles_since(start) / SAMPLES;
+    sink = sum;
+
+    result.max_error = 0;
+    for (usize i = 0; i < SAMPLES; i++) {
+        float error = fabsf(flow_per_click_table(pressures[i]) - get_flow_per_click_datasheet(pressures[i]));
+        result.max_error = fmaxf(result.max_error, error);
+    }
+}
+
+static Result float_result;
+static Result fixed_result;
+static PumpModelResult pump_result;
+
+int main() {
+    stdio_init_all();
+    profiler::init();
+    generate_inputs();
+
+    while (true) {
+        run<float>(float_result);
+        run<Q16_16>(fixed_result);
+        run_pump_model(pump_result);
+
+        float max_error = 0;
+        for (usize i = 0; i < SAMPLES; i++) {
+            max_error = fmaxf(max_error, fabsf(float_result.outputs[i] - fixed_result.outputs[i]));
+        }
+
+        printf("Cycles per update   kalman   pid\n");
+        printf("float              %7u %5u\n", static_cast<unsigned>(float_result.kalman_cycles),
+               static_cast<unsigned>(float_result.pid_cycles));
+        printf("Q16.16             %7u %5u\n", static_cast<unsigned>(fixed_result.kalman_cycles),
+               static_cast<unsigned>(fixed_result.pid_cycles));
+        printf("Max filtered temperature difference: %f °C\n", max_error);
+
+        // The pump update and the flow update each evaluate the curve once
+        constexpr u32 evaluations_per_second = control::PUMP_RATE_HZ + control::FLOW_RATE_HZ;
+        u32 saved = pump_result.polynomial_cycles - pump_result.table_cycles;
+        printf("Cycles per flow per click   polynomial %u, table %u, %u saved per second\n",
+               static_cast<unsigned>(pump_result.polynomial_cycles),
+               static_cast<unsigned>(pump_result.table_cycles),
+               static_cast<unsigned>(saved * evaluations_per_second));
+        printf("Max table difference: %f ml/click\n\n", pump_result.max_error);
+        sleep_ms(5000);
+    }
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include <cstdint>
+
+namespace sim {
+extern uint64_t now_us;
+
+// Moves the virtual clock forward, firing all timers that are due on the way
+void advance_to(uint64_t time_us);
+}
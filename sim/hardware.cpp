@@ -0,0 +1,127 @@
+// Simulated hardware backend, reads and drives the machine model
+#include "hardware/hardware.hpp"
+#include <cmath>
+#include "hardware/thermal_runaway.hpp"
+#include "config.hpp"
+#include "machine.hpp"
+#include "panic.hpp"
+
+using namespace hardware;
+
+namespace sim {
+bool switches[3] = {false};
+bool lights[3] = {false};
+}
+
+constexpr auto SCALE_TARE_TIME_MS = 500;
+
+static ThermalRunawayCheck thermal_check;
+static float scale_offset = 0;
+static absolute_time_t scale_tare_done = nil_time;
+
+void hardware::init() {}
+
+void hardware::set_heater(float val) {
+    sim::machine.heater = MIN(fmaxf(val, 0), 1);
+}
+
+void hardware::check_thermals() {
+    sim::tick();
+
+    i32 heater_power = sim::machine.heater * 100;
+    i32 pump_power = sim::machine.pump * 100;
+    if (thermal_check.has_fault(heater_power, pump_power, read_temp().temperature)) {
+        panic(Error::THERMAL_RUNAWAY);
+    }
+}
+
+void hardware::set_pump(float val) {
+    sim::machine.pump = MIN(fmaxf(val, 0), 1);
+}
+
+u32 hardware::get_and_reset_pump_clicks() {
+    u32 clicks = sim::machine.pump_clicks;
+    sim::machine.pump_clicks = 0;
+    return clicks;
+}
+
+void hardware::set_solenoid(bool active) {
+    sim::machine.solenoid = active;
+}
+
+void hardware::set_light(Switch which, bool active) {
+    sim::lights[which] = active;
+}
+
+bool hardware::get_switch(Switch which) {
+    return sim::switches[which];
+}
+
+u32 hardware::get_switch_changes() {
+    static bool last_state[3] = {false};
+    u32 changes = 0;
+    for (int i = 0; i < 3; i++) {
+        bool state = get_switch(static_cast<Switch>(i));
+        if (state != last_state[i]) {
+            last_state[i] = state;
+            changes |= 1 << i;
+        }
+    }
+    return changes;
+}
+
+PressureSample hardware::read_pressure() {
+    // Matches the 100 Hz rate of the oversampled ADC
+    absolute_time_t time = get_absolute_time() / 10'000 * 10'000;
+    return {sim::machine.measured_pressure(), time};
+}
+
+TempSample hardware::read_temp() {
+    // Matches the interval of the timer triggered reads
+    constexpr u64 interval_us = TEMP_READ_INTERVAL_MS * 1000;
+    absolute_time_t time = get_absolute_time() / interval_us * interval_us;
+    return {sim::machine.measured_temp(), time};
+}
+
+u32 hardware::get_temp_faults() {
+    return 0;
+}
+
+float hardware::read_weight() {
+    float weight = sim::machine.measured_weight();
+    if (scale_tare_done != nil_time && time_reached(scale_tare_done)) {
+        scale_offset = weight;
+        scale_tare_done = nil_time;
+    }
+    return weight - scale_offset;
+}
+
+void hardware::scale_start_tare() {
+    scale_tare_done = make_timeout_time_ms(SCALE_TARE_TIME_MS);
+}
+
+void hardware::scale_tare_immediately() {
+    scale_offset = sim::machine.measured_weight();
+}
+
+bool hardware::is_scale_connected() {
+    return true;
+}
+
+bool hardware::is_scale_taring() {
+    return scale_tare_done != nil_time;
+}
+
+// Settings are never written to flash in the simulator
+void hardware::flash_pause_point() {}
+
+bool hardware::is_power_just_pressed() {
+    static bool last_pressed = false;
+    bool curr_pressed = get_switch(Power);
+
+    if (curr_pressed != last_pressed) {
+        last_pressed = curr_pressed;
+        return curr_pressed;
+    }
+    return false;
+}
@@ -0,0 +1,25 @@
+#pragma once
+// The simulator has no SD card, brew logs are never written
+
+typedef unsigned int UINT;
+typedef struct {
+    int unused;
+} FIL;
+typedef enum {
+    FR_OK = 0,
+    FR_DISK_ERR,
+    FR_EXIST = 8,
+} FRESULT;
+
+#define FA_READ 0x01
+#define FA_WRITE 0x02
+#define FA_OPEN_ALWAYS 0x10
+
+inline FRESULT f_open(FIL*, const char*, int) { return FR_DISK_ERR; }
+inline FRESULT f_close(FIL*) { return FR_OK; }
+inline FRESULT f_write(FIL*, const void*, UINT, UINT* written) {
+    *written = 0;
+    return FR_DISK_ERR;
+}
+inline FRESULT f_mkdir(const char*) { return FR_OK; }
+inline FRESULT f_unlink(const char*) { return FR_OK; }
@@ -0,0 +1,4 @@
+#pragma once
+#include "pico/types.h"
+
+inline bool rtc_get_datetime(datetime_t*) { return false; }
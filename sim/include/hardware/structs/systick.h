@@ -0,0 +1,13 @@
+#pragma once
+#include <cstdint>
+
+typedef struct {
+    volatile uint32_t csr;
+    volatile uint32_t rvr;
+    volatile uint32_t cvr;
+    volatile uint32_t calib;
+} systick_hw_t;
+
+// No cycle counter on the host, profiles recorded by the simulator are all zero
+inline systick_hw_t sim_systick;
+inline systick_hw_t* const systick_hw = &sim_systick;
@@ -0,0 +1,10 @@
+#pragma once
+// The simulator is single threaded, interrupts are only delivered while
+// the virtual clock advances
+#include "pico/types.h"
+
+inline uint32_t save_and_disable_interrupts() { return 0; }
+inline void restore_interrupts(uint32_t) {}
+inline uint get_core_num() { return 0; }
+
+inline void __dmb() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
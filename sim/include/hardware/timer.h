@@ -0,0 +1,5 @@
+#pragma once
+#include "pico/time.h"
+
+inline uint32_t time_us_32() { return static_cast<uint32_t>(sim::now_us); }
+inline uint64_t time_us_64() { return sim::now_us; }
@@ -0,0 +1,16 @@
+#pragma once
+#include "pico/types.h"
+
+typedef struct {
+    bool locked;
+} mutex_t;
+
+#define auto_init_mutex(name) static mutex_t name
+
+inline void mutex_enter_blocking(mutex_t* mtx) { mtx->locked = true; }
+inline bool mutex_try_enter(mutex_t* mtx, uint32_t*) {
+    if (mtx->locked) return false;
+    mtx->locked = true;
+    return true;
+}
+inline void mutex_exit(mutex_t* mtx) { mtx->locked = false; }
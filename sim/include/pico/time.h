@@ -0,0 +1,41 @@
+#pragma once
+// Virtual clock replacing the pico SDK time API, advanced by the simulator
+#include "pico/types.h"
+
+constexpr absolute_time_t nil_time = 0;
+constexpr absolute_time_t at_the_end_of_time = INT64_MAX;
+
+namespace sim {
+extern uint64_t now_us;
+}
+
+inline absolute_time_t get_absolute_time() { return sim::now_us; }
+inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
+inline uint32_t to_ms_since_boot(absolute_time_t t) { return t / 1000; }
+inline absolute_time_t from_us_since_boot(uint64_t us) { return us; }
+inline absolute_time_t delayed_by_us(absolute_time_t t, uint64_t us) { return t + us; }
+inline absolute_time_t delayed_by_ms(absolute_time_t t, uint32_t ms) { return t + ms * 1000ull; }
+inline absolute_time_t make_timeout_time_us(uint64_t us) { return sim::now_us + us; }
+inline absolute_time_t make_timeout_time_ms(uint32_t ms) { return sim::now_us + ms * 1000ull; }
+inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) {
+    return static_cast<int64_t>(to - from);
+}
+inline bool time_reached(absolute_time_t t) { return sim::now_us >= t; }
+inline bool is_nil_time(absolute_time_t t) { return t == nil_time; }
+
+void sleep_ms(uint32_t ms);
+void sleep_us(uint64_t us);
+
+typedef int32_t alarm_id_t;
+typedef struct repeating_timer {
+    int64_t delay_us;
+    absolute_time_t next_time;
+    void* user_data;
+    bool (*callback)(struct repeating_timer*);
+    alarm_id_t alarm_id;
+} repeating_timer_t;
+typedef bool (*repeating_timer_callback_t)(repeating_timer_t* rt);
+
+bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback,
+                            void* user_data, repeating_timer_t* out);
+bool cancel_repeating_timer(repeating_timer_t* timer);
@@ -0,0 +1,19 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;
+
+typedef struct {
+    int16_t year;
+    int8_t month;
+    int8_t day;
+    int8_t dotw;
+    int8_t hour;
+    int8_t min;
+    int8_t sec;
+} datetime_t;
+
+#define MIN(a, b) ((b) > (a) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
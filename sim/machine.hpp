@@ -0,0 +1,145 @@
+#pragma once
+#include <cmath>
+#include <random>
+#include "control/pump.hpp"
+#include "inttypes.hpp"
+
+namespace sim {
+// Lumped physical model of a Gaggia Classic with a vibratory pump,
+// stepped with a fixed time step by the simulator
+struct Machine {
+    // Boiler
+    static constexpr float HEATER_POWER_W = 1050;
+    static constexpr float BOILER_CAPACITY_J_PER_K = 700;
+    static constexpr float BOILER_LOSS_W_PER_K = 0.9;
+    static constexpr float AMBIENT_TEMP = 22;
+    static constexpr float INLET_TEMP = 22;
+    static constexpr float THERMOCOUPLE_TAU_S = 4;
+
+    // Hydraulics
+    static constexpr float COMPLIANCE_ML_PER_BAR = 1.5;
+    static constexpr float OPV_PRESSURE = 11;
+    static constexpr float OPV_FLOW_PER_BAR = 5;
+    static constexpr float LEAK_FLOW_PER_BAR = 0.01;
+    static constexpr float PUCK_FILL_ML = 8;
+    static constexpr float DRY_PUCK_RESISTANCE = 0.2;
+    static constexpr float DRIP_TAU_S = 1.5;
+    static constexpr float PRESSURE_NOISE = 0.05;
+    static constexpr float WEIGHT_NOISE = 0.05;
+
+    // Saturated puck resistance in bar per ml/s, higher is a finer grind
+    float puck_resistance = 4;
+    // Share of the datasheet flow per click the pump still delivers
+    float pump_wear = 1;
+
+    // Inputs
+    float heater = 0;
+    float pump = 0;
+    bool solenoid = false;
+
+    // State
+    float boiler_temp = AMBIENT_TEMP;
+    float thermocouple_temp = AMBIENT_TEMP;
+    float pressure = 0;
+    float puck_water = 0;
+    float dripping = 0;
+    float cup_weight = 0;
+    float pump_flow = 0;
+    float pump_accumulator = 0;
+    float click_volume = 0;
+    float click_time_left = 0;
+    float mains_time = 0;
+    u32 pump_clicks = 0;
+    u32 total_clicks = 0;
+
+    std::mt19937 rng {1234};
+    std::normal_distribution<float> noise {0, 1};
+
+    // Gauge pressure of saturated steam, from the Antoine equation for water
+    static float vapor_pressure(float temp) {
+        if (temp <= 100) return 0;
+        float mmhg = std::pow(10.f, 8.14019f - 1810.94f / (244.485f + temp));
+        return (mmhg - 760) / 750.06f;
+    }
+
+    void step(float dt) {
+        step_pump(dt);
+
+        // Flow out of the boiler
+        float out_flow = LEAK_FLOW_PER_BAR * pressure;
+        if (pressure > OPV_PRESSURE) {
+            out_flow += (pressure - OPV_PRESSURE) * OPV_FLOW_PER_BAR;
+        }
+        float puck_flow = 0;
+        if (solenoid) {
+            float resistance = puck_water < PUCK_FILL_ML ? DRY_PUCK_RESISTANCE : puck_resistance;
+            puck_flow = fmaxf(pressure, 0) / resistance;
+            out_flow += puck_flow;
+        }
+        pressure += (pump_flow - out_flow) * dt / COMPLIANCE_ML_PER_BAR;
+        if (!solenoid && pressure < 0) pressure = 0;
+        if (solenoid) pressure = fmaxf(pressure, 0);
+
+        // Water passes the puck once it is saturated and drips into the cup
+        if (puck_water < PUCK_FILL_ML) {
+            puck_water += puck_flow * dt;
+        } else {
+            dripping += puck_flow * dt;
+        }
+        float dripped = dripping * dt / DRIP_TAU_S;
+        dripping -= dripped;
+        cup_weight += dripped;
+
+        // Boiler energy balance, fresh water from the pump cools it down
+        float power = heater * HEATER_POWER_W
+                      - BOILER_LOSS_W_PER_K * (boiler_temp - AMBIENT_TEMP)
+                      - pump_flow * 4.186f * (boiler_temp - INLET_TEMP);
+        boiler_temp += power * dt / BOILER_CAPACITY_J_PER_K;
+        thermocouple_temp += (boiler_temp - thermocouple_temp) * dt / THERMOCOUPLE_TAU_S;
+    }
+
+    // The pump gets a pulse every other mains half-wave, like the PSM
+    // dimmer, and each click pushes its volume over one mains period
+    void step_pump(float dt) {
+        constexpr float PERIOD = 1.f / MAINS_FREQUENCY_HZ;
+        mains_time += dt;
+        if (mains_time >= PERIOD) {
+            mains_time -= PERIOD;
+            pump_accumulator += pump;
+            if (pump_accumulator >= 1) {
+                pump_accumulator -= 1;
+                pump_clicks++;
+                total_clicks++;
+                click_volume = get_flow_per_click_datasheet(fmaxf(pressure, 0)) * pump_wear;
+                click_time_left = PERIOD;
+            }
+        }
+        if (click_time_left > 0) {
+            click_time_left -= dt;
+            pump_flow = click_volume / PERIOD;
+        } else {
+            pump_flow = 0;
+        }
+    }
+
+    float measured_pressure() {
+        float sensed = pressure + (solenoid ? 0 : vapor_pressure(boiler_temp));
+        return sensed + noise(rng) * PRESSURE_NOISE;
+    }
+
+    float measured_weight() {
+        return cup_weight + noise(rng) * WEIGHT_NOISE;
+    }
+
+    // MAX6675 resolution
+    float measured_temp() {
+        return std::floor(thermocouple_temp * 4) / 4;
+    }
+};
+
+extern Machine machine;
+
+// Advances the virtual clock, the machine and the scenario by one step.
+// Called once per main loop iteration.
+void tick();
+}
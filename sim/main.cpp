@@ -0,0 +1,435 @@
+// Runs the firmware control loop against the machine model on a virtual
+// clock, going through a full warm-up, brew and steam cycle
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "brew_profile.hpp"
+#include "calibration.hpp"
+#include "clock.hpp"
+#include "control/control.hpp"
+#include "control/pump.hpp"
+#include "control/protocol.hpp"
+#include "control/states.hpp"
+#include "hardware/hardware.hpp"
+#include "hardware/sd_card.hpp"
+#include "machine.hpp"
+#include "network/network.hpp"
+#include "network/ntp.hpp"
+#include "panic.hpp"
+#include "settings.hpp"
+
+namespace sim {
+Machine machine;
+extern bool switches[3];
+extern bool lights[3];
+}
+
+constexpr u64 TICK_US = 1000;
+constexpr float TICK_S = TICK_US / 1e6f;
+constexpr u32 MAX_SHOTS = 10;
+
+enum class Phase {
+    PowerOn,
+    SchedulerCheck,
+    Autotune,
+    WarmUp,
+    Brew,
+    Drip,
+    Rest,
+    Steam,
+    Cooldown,
+    PowerOff,
+};
+
+static struct {
+    Phase phase = Phase::PowerOn;
+    u64 phase_start = 0;
+    u64 ready_time = 0;
+    u64 shot_start = 0;
+    u64 shot_end = 0;
+    u64 steam_start = 0;
+    u64 steam_ready = 0;
+    float start_temp = 0;
+    float min_brew_temp = INFINITY;
+    float max_brew_temp = -INFINITY;
+    float pressure_abs_error = 0;
+    float pressure_max_error = 0;
+    u32 pressure_samples = 0;
+    float plateau_weight = NAN;
+    u32 plateau_clicks = 0;
+    float cup_flow_per_click = NAN;
+    float max_temp = -INFINITY;
+    float yield = 0;
+    u32 shots = 0;
+    control::WeightLanding landings[MAX_SHOTS];
+    u64 autotune_time = 0;
+    control::HeaterMetrics warm_up_metrics;
+    control::HeaterMetrics brew_metrics;
+    control::HeaterMetrics cooldown_metrics;
+} run;
+
+static Settings sim_settings;
+static FILE* trace = nullptr;
+static bool autotune = false;
+static bool profile = false; // Brews with declining_profile()
+static bool check_scheduler = false; // Only runs the Off -> Standby check
+static u32 shot_count = 1;
+static auto wall_start = std::chrono::steady_clock::now();
+
+static double seconds(u64 us) { return us / 1e6; }
+
+static void print_metrics(const char* name, const control::HeaterMetrics& m) {
+    char label[32];
+    snprintf(label, sizeof(label), "%s heater:", name);
+    printf("%-25s %8.2f °C overshoot, ", label, m.overshoot);
+    if (m.settling_time >= 0) {
+        printf("settled in %.1f s\n", m.settling_time);
+    } else {
+        printf("not settled\n");
+    }
+}
+
+static void report() {
+    double wall_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - wall_start).count();
+    float mean_error = run.pressure_samples ? run.pressure_abs_error / run.pressure_samples : NAN;
+
+    if (autotune) {
+        printf("Autotune:                 %8.1f s, kP %.4f kI %.5f kD %.4f\n",
+               seconds(run.autotune_time), calibration::get().heater_kp, calibration::get().heater_ki,
+               calibration::get().heater_kd);
+    }
+    printf("Warm-up to brew ready:    %8.1f s\n", seconds(run.ready_time - run.autotune_time));
+    printf("Brew start temperature:   %8.2f °C\n", run.start_temp);
+    printf("Brew temperature range:   %8.2f - %.2f °C, %.2f °C droop\n", run.min_brew_temp,
+           run.max_brew_temp, run.start_temp - run.min_brew_temp);
+    print_metrics("Warm-up", run.warm_up_metrics);
+    print_metrics("Brew", run.brew_metrics);
+    print_metrics("Steam cool-down", run.cooldown_metrics);
+    printf("Plateau pressure error:   %8.3f bar mean, %.3f bar max\n", mean_error, run.pressure_max_error);
+    printf("Shot time:                %8.1f s\n", seconds(run.shot_end - run.shot_start));
+    printf("Yield:                    %8.1f g (target %.1f g)\n", run.yield, sim_settings.brew_weight);
+    for (u32 i = 0; i < run.shots; i++) {
+        const control::WeightLanding& l = run.landings[i];
+        printf("Shot %2u landing:          %+8.2f g at %.1f g, drip lag %.2f s\n", static_cast<unsigned>(i + 1),
+               l.error, l.weight, l.drip_lag);
+    }
+    float model_flow = get_flow_per_click(sim_settings.brew_pressure, calibration::get().pump_flow_gain, get_pump_zero());
+    printf("Flow model:               %8.3f gain, %.4f ml/click zero, %+.1f %% off the cup\n",
+           calibration::get().pump_flow_gain, get_pump_zero(), (model_flow / run.cup_flow_per_click - 1) * 100);
+    printf("Steam heat-up:            %8.1f s\n", seconds(run.steam_ready - run.steam_start));
+    printf("Max temperature:          %8.2f °C\n", run.max_temp);
+    printf("Largest coroutine frame:  %8u bytes of %u\n", static_cast<unsigned>(Coroutine::largest_frame),
+           static_cast<unsigned>(Coroutine::FRAME_SIZE));
+    protocol::TransitionHistory history = protocol::transition_history();
+    static const char* cause_names[] = {"switch", "network", "coroutine"};
+    for (u32 i = history.count > protocol::TRANSITION_HISTORY_SIZE ? history.count - protocol::TRANSITION_HISTORY_SIZE : 0;
+         i < history.count; i++) {
+        const protocol::Transition& t = history.entries[i % protocol::TRANSITION_HISTORY_SIZE];
+        printf("Transition at %6.1f s:  %d -> %d by %s after %.1f s\n", seconds(t.time), t.old_state, t.new_state,
+               cause_names[static_cast<u32>(t.cause)], t.time_in_state_ms / 1000.0);
+    }
+    for (usize i = 0; i < protocol::TASK_COUNT; i++) {
+        TaskStats stats = protocol::task_stats(i);
+        printf("Task %u: %8u runs, %u deadline misses, %u us max jitter\n",
+               static_cast<unsigned>(i), stats.runs, stats.deadline_misses, stats.max_jitter_us);
+    }
+    printf("Simulated %.1f s in %.1f ms\n", seconds(sim::now_us), wall_ms);
+}
+
+[[noreturn]] static void finish(int status) {
+    report();
+    if (trace) fclose(trace);
+    exit(status);
+}
+
+static void set_phase(Phase phase) {
+    run.phase = phase;
+    run.phase_start = sim::now_us;
+}
+
+static double phase_time() {
+    return seconds(sim::now_us - run.phase_start);
+}
+
+// With a fresh puck and an empty cup
+static void start_shot() {
+    sim::Machine& m = sim::machine;
+    m.puck_water = 0;
+    m.dripping = 0;
+    m.cup_weight = 0;
+    run.shot_start = sim::now_us;
+    run.start_temp = m.measured_temp();
+    run.plateau_weight = NAN;
+    sim::switches[hardware::Brew] = true;
+    set_phase(Phase::Brew);
+}
+
+static void step_scenario() {
+    using hardware::Brew, hardware::Power, hardware::Steam;
+    sim::Machine& m = sim::machine;
+    int state = protocol::get_state_id();
+
+    switch (run.phase) {
+    case Phase::PowerOn: {
+        // The scheduler check leaves the machine off for a while first
+        double off_time = check_scheduler ? 10 : 0;
+        sim::switches[Power] = phase_time() >= off_time && phase_time() < off_time + 0.2;
+        if (phase_time() < off_time + 0.2) break;
+        if (check_scheduler) {
+            set_phase(Phase::SchedulerCheck);
+        } else if (autotune) {
+            protocol::schedule_state_change<AutotuneState>(protocol::TransitionCause::Network);
+            set_phase(Phase::Autotune);
+        } else {
+            set_phase(Phase::WarmUp);
+        }
+        break;
+    }
+    case Phase::SchedulerCheck:
+        // Time spent in Off must not show up as missed deadlines
+        if (phase_time() < 1) break;
+        if (state != StandbyState::ID) {
+            printf("Scheduler check: machine didn't turn on\n");
+            exit(1);
+        }
+        for (usize i = 0; i < protocol::TASK_COUNT; i++) {
+            TaskStats stats = protocol::task_stats(i);
+            if (stats.deadline_misses > 0) {
+                printf("Scheduler check: task %u missed %u deadlines after Off\n", static_cast<unsigned>(i),
+                       stats.deadline_misses);
+                exit(1);
+            }
+        }
+        exit(0);
+    case Phase::Autotune:
+        // Runs the warm-up with the new gains from a cold boiler again
+        if (phase_time() > 1 && state == StandbyState::ID) {
+            m.boiler_temp = sim::Machine::AMBIENT_TEMP;
+            m.thermocouple_temp = sim::Machine::AMBIENT_TEMP;
+            control::reset();
+            run.autotune_time = sim::now_us;
+            set_phase(Phase::WarmUp);
+        }
+        break;
+    case Phase::WarmUp:
+        if (sim::lights[Brew]) {
+            run.warm_up_metrics = control::sensors_snapshot().heater_metrics;
+            run.ready_time = sim::now_us;
+            start_shot();
+        } else if (phase_time() > 20 * 60) {
+            printf("Machine never reached brew temperature\n");
+            finish(1);
+        }
+        break;
+    case Phase::Brew: {
+        float temp = m.measured_temp();
+        run.min_brew_temp = fminf(run.min_brew_temp, temp);
+        run.max_brew_temp = fmaxf(run.max_brew_temp, temp);
+
+        bool plateau = phase_time() > sim_settings.preinfusion_time + 8;
+        if (plateau && m.solenoid && state == BrewState::ID) {
+            float error = fabsf(control::sensors().pressure - sim_settings.brew_pressure);
+            run.pressure_abs_error += error;
+            run.pressure_max_error = fmaxf(run.pressure_max_error, error);
+            run.pressure_samples++;
+            if (std::isnan(run.plateau_weight)) {
+                run.plateau_weight = m.cup_weight;
+                run.plateau_clicks = m.total_clicks;
+            }
+        }
+        if (!m.solenoid || phase_time() > 60) {
+            run.cup_flow_per_click = (m.cup_weight - run.plateau_weight) / (m.total_clicks - run.plateau_clicks);
+            run.shot_end = sim::now_us;
+            set_phase(Phase::Drip);
+        }
+        break;
+    }
+    case Phase::Drip:
+        if (phase_time() > 10) {
+            run.brew_metrics = control::sensors_snapshot().heater_metrics;
+            run.yield = m.cup_weight;
+            run.landings[run.shots++] = control::weight_landing(); // The cup settled by now
+            sim::switches[Brew] = false;
+            set_phase(Phase::Rest);
+        }
+        break;
+    case Phase::Rest:
+        if (phase_time() > 30 && run.shots < shot_count) {
+            if (sim::lights[Brew]) start_shot();
+        } else if (phase_time() > 30) {
+            run.steam_start = sim::now_us;
+            sim::switches[Steam] = true;
+            set_phase(Phase::Steam);
+        }
+        break;
+    case Phase::Steam:
+        if (run.steam_ready == 0 && sim::lights[Steam] && state == SteamState::ID) {
+            run.steam_ready = sim::now_us;
+        }
+        if (run.steam_ready != 0 && seconds(sim::now_us - run.steam_ready) > 15) {
+            sim::switches[Steam] = false;
+            set_phase(Phase::Cooldown);
+        } else if (phase_time() > 10 * 60) {
+            printf("Machine never reached steam temperature\n");
+            finish(1);
+        }
+        break;
+    case Phase::Cooldown:
+        run.cooldown_metrics = control::sensors_snapshot().heater_metrics;
+        if (run.cooldown_metrics.settling_time >= 0 || phase_time() > 15 * 60) {
+            set_phase(Phase::PowerOff);
+        }
+        break;
+    case Phase::PowerOff:
+        sim::switches[Power] = phase_time() < 0.2;
+        if (state == OffState::ID) finish(0);
+        break;
+    }
+}
+
+void sim::tick() {
+    advance_to(now_us + TICK_US);
+    machine.step(TICK_S);
+    run.max_temp = fmaxf(run.max_temp, machine.boiler_temp);
+    step_scenario();
+
+    if (trace && now_us % 100'000 == 0) {
+        const control::Sensors& s = control::sensors();
+        fprintf(trace, "%.1f,%d,%.2f,%.2f,%.3f,%.3f,%.2f,%.2f,%.2f,%.2f\n",
+                seconds(now_us), protocol::get_state_id(), machine.boiler_temp,
+                s.temperature, machine.pressure, s.pressure, s.flow, machine.cup_weight,
+                machine.heater, machine.pump);
+    }
+}
+
+// Firmware services the simulator doesn't model
+
+void network::enqueue_message(const OutMessages&) {}
+void network::process_outgoing_messages() {}
+void network::process_incoming_messages() {}
+usize network::message_queue_size() { return 0; }
+
+void settings::init() {}
+const Settings& settings::get() { return sim_settings; }
+void settings::update(Settings& new_settings) { sim_settings = new_settings; }
+void settings::flush() {}
+
+static Calibration sim_calibration;
+void calibration::init() {}
+const Calibration& calibration::get() { return sim_calibration; }
+void calibration::update(const Calibration& new_calibration, bool) { sim_calibration = new_calibration; }
+void calibration::flush() {}
+
+static BrewProfile sim_profile;
+static BrewProfile shot_profile;
+void brew_profile::init() {}
+const BrewProfile& brew_profile::start_shot() {
+    shot_profile = sim_profile.phase_count > 0 ? sim_profile : BrewProfile::from_settings(sim_settings);
+    return shot_profile;
+}
+const BrewProfile& brew_profile::uploaded() { return sim_profile; }
+void brew_profile::update(const BrewProfile& profile) { sim_profile = profile; }
+void brew_profile::flush() {}
+
+// Flow preinfusion up to 3.5 bar, a ramp to 9 bar and a decline to 6 bar
+// until the brew weight
+static BrewProfile declining_profile() {
+    using P = ProfilePhase;
+    BrewProfile profile;
+    profile.phase_count = 3;
+    profile.phases[0] = {PhaseTarget::Flow, PhaseExit::PressureAbove, P::to_fixed(4, P::FLOW_UNIT),
+                         P::to_fixed(4, P::FLOW_UNIT), 0, P::to_fixed(4, P::PRESSURE_UNIT),
+                         P::to_fixed(3.5, P::PRESSURE_UNIT), P::to_fixed(10, P::TIME_UNIT)};
+    profile.phases[1] = {PhaseTarget::Pressure, PhaseExit::Weight, P::to_fixed(3.5, P::PRESSURE_UNIT),
+                         P::to_fixed(9, P::PRESSURE_UNIT), P::to_fixed(4, P::TIME_UNIT), 0,
+                         P::to_fixed(8, P::WEIGHT_UNIT), 0};
+    profile.phases[2] = {PhaseTarget::Pressure, PhaseExit::Weight, P::to_fixed(9, P::PRESSURE_UNIT),
+                         P::to_fixed(6, P::PRESSURE_UNIT), P::to_fixed(15, P::TIME_UNIT), 0,
+                         P::to_fixed(sim_settings.brew_weight, P::WEIGHT_UNIT), 0};
+    return profile;
+}
+
+u64 ntp::to_timestamp(absolute_time_t time) { return to_us_since_boot(time); }
+
+void sd_card::init() {}
+void sd_card::deinit() {}
+
+[[noreturn]] void panic(Error error) {
+    printf("Panic with error %d at %.3f s\n", static_cast<int>(error), seconds(sim::now_us));
+    if (error == Error::COROUTINE_TOO_BIG) {
+        printf("Coroutine frame of %u bytes, frames are %u bytes\n",
+               static_cast<unsigned>(Coroutine::largest_frame), static_cast<unsigned>(Coroutine::FRAME_SIZE));
+    }
+    finish(2);
+}
+
+// Starts a coroutine and returns its frame size. A frame that doesn't fit
+// panics in the allocation like on the machine.
+static usize frame_size(Coroutine (*start)()) {
+    Coroutine::largest_frame = 0;
+    start();
+    Coroutine::destroy_all();
+    return Coroutine::largest_frame;
+}
+
+// Prints the frame size of every state's coroutine and of the tasks they spawn
+template<typename... S>
+static void check_frames(std::tuple<S...>*) {
+    printf("Coroutine frames, %u bytes each:\n", static_cast<unsigned>(Coroutine::FRAME_SIZE));
+    ((printf("  State %d: %3u bytes\n", S::ID, static_cast<unsigned>(frame_size(S::coroutine)))), ...);
+    printf("  Prefill: %3u bytes\n", static_cast<unsigned>(frame_size(StandbyState::prefill)));
+    exit(0);
+}
+
+static void usage(const char* name) {
+    printf("Usage: %s [--grind <bar per ml/s>] [--pump-wear <factor>] [--weight <g>] [--trace <file.csv>] [--shots <count>] [--autotune] [--profile] [--check-frames] [--check-scheduler]\n", name);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    sim_settings.brew_weight = 36;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--autotune")) {
+            autotune = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--profile")) {
+            profile = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--check-scheduler")) {
+            check_scheduler = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--check-frames")) {
+            check_frames(static_cast<States*>(nullptr));
+        }
+        if (i + 1 >= argc) usage(argv[0]);
+        if (!strcmp(argv[i], "--grind")) {
+            sim::machine.puck_resistance = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--pump-wear")) {
+            sim::machine.pump_wear = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--weight")) {
+            sim_settings.brew_weight = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--shots")) {
+            shot_count = std::clamp(atoi(argv[++i]), 1, static_cast<int>(MAX_SHOTS));
+        } else if (!strcmp(argv[i], "--trace")) {
+            trace = fopen(argv[++i], "w");
+            if (!trace) usage(argv[0]);
+            fprintf(trace, "time,state,boiler_temp,temp,true_pressure,pressure,flow,weight,heater,pump\n");
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (profile) brew_profile::update(declining_profile());
+
+    wall_start = std::chrono::steady_clock::now();
+    hardware::init();
+    protocol::main_loop();
+}
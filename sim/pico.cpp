@@ -0,0 +1,58 @@
+// Virtual time for the pico SDK time API
+#include "clock.hpp"
+#include <algorithm>
+#include <vector>
+#include <pico/time.h>
+
+namespace sim {
+uint64_t now_us = 0;
+}
+
+static std::vector<repeating_timer_t*> timers;
+
+bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback,
+                            void* user_data, repeating_timer_t* out) {
+    out->delay_us = delay_us;
+    out->next_time = sim::now_us + (delay_us < 0 ? -delay_us : delay_us);
+    out->user_data = user_data;
+    out->callback = callback;
+    out->alarm_id = timers.size() + 1;
+    timers.push_back(out);
+    return true;
+}
+
+bool cancel_repeating_timer(repeating_timer_t* timer) {
+    auto it = std::find(timers.begin(), timers.end(), timer);
+    if (it == timers.end()) return false;
+    timers.erase(it);
+    return true;
+}
+
+void sim::advance_to(uint64_t time_us) {
+    while (true) {
+        auto next = std::min_element(timers.begin(), timers.end(), [](auto* a, auto* b) {
+            return a->next_time < b->next_time;
+        });
+        if (next == timers.end() || (*next)->next_time > time_us) break;
+
+        repeating_timer_t* timer = *next;
+        now_us = timer->next_time;
+        if (!timer->callback(timer)) {
+            timers.erase(next);
+            continue;
+        }
+        // Negative delays are measured from the previous target, like the SDK
+        timer->next_time = timer->delay_us < 0
+                               ? timer->next_time - timer->delay_us
+                               : now_us + timer->delay_us;
+    }
+    now_us = time_us;
+}
+
+void sleep_us(uint64_t us) {
+    sim::advance_to(sim::now_us + us);
+}
+
+void sleep_ms(uint32_t ms) {
+    sleep_us(ms * 1000ull);
+}
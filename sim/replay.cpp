@@ -0,0 +1,350 @@
+// Replays SD card brew logs through the firmware's filters and controllers
+// and reports per shot metrics, for tuning their constants offline
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+#include "clock.hpp"
+#include "control/boiler.hpp"
+#include "control/brew_log.hpp"
+#include "control/impl/kalman_filter.hpp"
+#include "control/impl/pid.hpp"
+#include "control/pump.hpp"
+#include "control/tuning.hpp"
+#include "calibration.hpp"
+#include "panic.hpp"
+#include "settings.hpp"
+
+namespace fs = std::filesystem;
+
+// Version 4 logs were written before raw sensor values were recorded,
+// their filtered values get filtered a second time
+struct BrewLogV4 {
+    float time;
+    struct {
+        float pressure;
+        float temperature;
+        float weight;
+        float flow;
+        u32 pump_clicks;
+        float total_flow;
+    } sensors;
+    bool steam_switch_pressed;
+};
+
+// Version 5 logs were written before the heater output was recorded
+struct BrewLogV5 {
+    float time;
+    struct {
+        float pressure;
+        float temperature;
+        float weight;
+        float flow;
+        u32 pump_clicks;
+        float total_flow;
+        float raw_pressure;
+        float raw_temperature;
+    } sensors;
+    bool steam_switch_pressed;
+};
+
+struct Sample {
+    float time;
+    float pressure;
+    float temperature;
+    float flow;
+};
+
+struct SignalMetrics {
+    float lag_ms;
+    float noise_reduction_db;
+};
+
+struct ShotMetrics {
+    usize samples;
+    float duration;
+    SignalMetrics pressure;
+    SignalMetrics temperature;
+    float temp_mean_error;
+    float heater_mean;
+    float heater_saturated;
+    float pump_mean;
+    float pump_chatter;
+};
+
+static Settings replay_settings;
+static Calibration replay_calibration;
+static tuning::FilterParams pressure_params = tuning::PRESSURE_FILTER;
+static tuning::FilterParams temp_params = tuning::TEMP_FILTER;
+static tuning::PIDParams pid_params = tuning::HEATER_PID;
+
+const Settings& settings::get() { return replay_settings; }
+const Calibration& calibration::get() { return replay_calibration; }
+
+[[noreturn]] void panic(Error error) {
+    printf("Panic with error %d\n", static_cast<int>(error));
+    exit(2);
+}
+
+static bool load_log(const fs::path& path, std::vector<Sample>& samples) {
+    std::ifstream file(path, std::ios::binary);
+    i32 version;
+    if (!file.read(reinterpret_cast<char*>(&version), sizeof(version))) return false;
+
+    samples.clear();
+    if (version == 4) {
+        BrewLogV4 log;
+        while (file.read(reinterpret_cast<char*>(&log), sizeof(log))) {
+            samples.push_back({log.time, log.sensors.pressure, log.sensors.temperature, log.sensors.flow});
+        }
+    } else if (version == 5) {
+        BrewLogV5 log;
+        while (file.read(reinterpret_cast<char*>(&log), sizeof(log))) {
+            samples.push_back({log.time, log.sensors.raw_pressure, log.sensors.raw_temperature,
+                               log.sensors.flow});
+        }
+    } else if (version == BREW_LOG_VERSION) {
+        BrewLog log;
+        while (file.read(reinterpret_cast<char*>(&log), sizeof(log))) {
+            samples.push_back({log.time, log.sensors.raw_pressure, log.sensors.raw_temperature,
+                               log.sensors.flow});
+        }
+    } else {
+        return false;
+    }
+    return samples.size() > 1;
+}
+
+static float rms_diff(const std::vector<float>& values) {
+    double sum = 0;
+    for (usize i = 1; i < values.size(); i++) {
+        double d = values[i] - values[i - 1];
+        sum += d * d;
+    }
+    return std::sqrt(sum / (values.size() - 1));
+}
+
+// Lag is the shift of the filtered signal that best matches the raw one
+static SignalMetrics signal_metrics(const std::vector<float>& raw,
+                                    const std::vector<float>& filtered,
+                                    float sample_period) {
+    constexpr usize MAX_SHIFT = 20;
+    usize n = raw.size();
+    usize best_shift = 0;
+    double best_error = INFINITY;
+    for (usize shift = 0; shift <= MAX_SHIFT && shift + 1 < n; shift++) {
+        double error = 0;
+        for (usize i = 0; i + shift < n; i++) {
+            double d = filtered[i + shift] - raw[i];
+            error += d * d;
+        }
+        error /= n - shift;
+        if (error < best_error) {
+            best_error = error;
+            best_shift = shift;
+        }
+    }
+
+    float raw_noise = rms_diff(raw);
+    float filtered_noise = rms_diff(filtered);
+    float reduction = filtered_noise > 0 ? 20 * std::log10(raw_noise / filtered_noise) : INFINITY;
+    return {best_shift * sample_period * 1000, reduction};
+}
+
+// The logs have a sample every 100 ms, the firmware filters and controls
+// faster than that. The replay steps everything at the firmware's rates and
+// interpolates the logged inputs linearly in between.
+constexpr u32 TICK_HZ = control::PRESSURE_RATE_HZ;
+constexpr u64 TICK_US = 1'000'000 / TICK_HZ;
+static_assert(TICK_HZ % control::TEMP_RATE_HZ == 0 && TICK_HZ % control::HEATER_RATE_HZ == 0 &&
+              TICK_HZ % control::PUMP_RATE_HZ == 0, "Every update rate must divide the tick rate");
+
+static bool due(u64 tick, u32 rate_hz) {
+    return tick % (TICK_HZ / rate_hz) == 0;
+}
+
+static ShotMetrics replay(const std::vector<Sample>& samples) {
+    SimpleKalmanFilter<tuning::Number> pressure_filter(pressure_params.err_measure, pressure_params.err_estimate, pressure_params.q);
+    SimpleKalmanFilter<tuning::Number> temp_filter(temp_params.err_measure, temp_params.err_estimate, temp_params.q);
+    PID<tuning::Number> heater_pid(pid_params.kP, pid_params.kI, pid_params.kD, 0, 1);
+    heater_pid.set_target(replay_settings.brew_temp);
+
+    std::vector<float> raw_p, filt_p, raw_t, filt_t;
+    raw_p.reserve(samples.size());
+    filt_p.reserve(samples.size());
+    raw_t.reserve(samples.size());
+    filt_t.reserve(samples.size());
+
+    sim::now_us = 0;
+    pressure_filter.reset(samples[0].pressure);
+    temp_filter.reset(samples[0].temperature);
+    heater_pid.reset(samples[0].temperature);
+    PressureController pressure_controller;
+    pressure_controller.reset(samples[0].pressure);
+
+    control::Sensors sensors {};
+    sensors.pressure = samples[0].pressure;
+    sensors.temperature = samples[0].temperature;
+    raw_p.push_back(samples[0].pressure);
+    filt_p.push_back(sensors.pressure);
+    raw_t.push_back(samples[0].temperature);
+    filt_t.push_back(sensors.temperature);
+
+    ShotMetrics m {};
+    m.temp_mean_error = fabsf(sensors.temperature - replay_settings.brew_temp);
+    usize heater_updates = 0, pump_updates = 0;
+    float last_pump = 0;
+    u64 tick = 1;
+    for (usize i = 1; i < samples.size(); i++) {
+        const Sample& from = samples[i - 1];
+        const Sample& to = samples[i];
+        for (; tick * TICK_US < (to.time - samples[0].time) * 1e6; tick++) {
+            sim::advance_to(tick * TICK_US);
+            float t = (sim::now_us / 1e6f + samples[0].time - from.time) / (to.time - from.time);
+
+            sensors.pressure = static_cast<float>(pressure_filter.update(std::lerp(from.pressure, to.pressure, t)));
+            if (due(tick, control::TEMP_RATE_HZ)) {
+                sensors.temperature = static_cast<float>(temp_filter.update(std::lerp(from.temperature, to.temperature, t)));
+            }
+            if (due(tick, control::HEATER_RATE_HZ)) {
+                float feedforward = fminf(get_heater_feedforward(from.flow, sensors.temperature), 1);
+                heater_pid.set_output_limits(0, 1 - feedforward);
+                float heater = static_cast<float>(heater_pid.update(sensors.temperature)) + feedforward;
+                m.heater_mean += heater;
+                m.heater_saturated += heater <= 0 || heater >= 1;
+                heater_updates++;
+            }
+            if (due(tick, control::PUMP_RATE_HZ)) {
+                float pump = pressure_controller.update(sensors, replay_settings.brew_pressure, 99999);
+                m.pump_mean += pump;
+                m.pump_chatter += fabsf(pump - last_pump);
+                last_pump = pump;
+                pump_updates++;
+            }
+        }
+
+        raw_p.push_back(to.pressure);
+        filt_p.push_back(sensors.pressure);
+        raw_t.push_back(to.temperature);
+        filt_t.push_back(sensors.temperature);
+        m.temp_mean_error += fabsf(sensors.temperature - replay_settings.brew_temp);
+    }
+
+    usize n = samples.size();
+    m.samples = n;
+    m.duration = samples.back().time - samples.front().time;
+    float period = m.duration / (n - 1);
+    m.pressure = signal_metrics(raw_p, filt_p, period);
+    m.temperature = signal_metrics(raw_t, filt_t, period);
+    m.temp_mean_error /= n;
+    m.heater_mean /= MAX(heater_updates, 1);
+    m.heater_saturated /= MAX(heater_updates, 1);
+    m.pump_mean /= MAX(pump_updates, 1);
+    m.pump_chatter /= MAX(pump_updates, 1);
+    return m;
+}
+
+static bool parse_floats(const char* arg, float* out, int count) {
+    for (int i = 0; i < count; i++) {
+        char* end;
+        out[i] = strtof(arg, &end);
+        if (end == arg) return false;
+        arg = *end == ',' ? end + 1 : end;
+    }
+    return true;
+}
+
+static void usage(const char* name) {
+    printf("Usage: %s [options] <log file or directory>...\n"
+           "  --pressure-filter <err_measure,err_estimate,q>\n"
+           "  --temp-filter <err_measure,err_estimate,q>\n"
+           "  --pid <kP,kI,kD>\n"
+           "  --brew-temp <°C>\n"
+           "  --brew-pressure <bar>\n"
+           "  --quiet               only print the summary\n", name);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    std::vector<fs::path> paths;
+    bool quiet = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (!strcmp(arg, "--quiet")) {
+            quiet = true;
+        } else if (!strcmp(arg, "--pressure-filter") && has_value) {
+            if (!parse_floats(argv[++i], &pressure_params.err_measure, 3)) usage(argv[0]);
+        } else if (!strcmp(arg, "--temp-filter") && has_value) {
+            if (!parse_floats(argv[++i], &temp_params.err_measure, 3)) usage(argv[0]);
+        } else if (!strcmp(arg, "--pid") && has_value) {
+            if (!parse_floats(argv[++i], &pid_params.kP, 3)) usage(argv[0]);
+        } else if (!strcmp(arg, "--brew-temp") && has_value) {
+            replay_settings.brew_temp = atof(argv[++i]);
+        } else if (!strcmp(arg, "--brew-pressure") && has_value) {
+            replay_settings.brew_pressure = atof(argv[++i]);
+        } else if (arg[0] == '-') {
+            usage(argv[0]);
+        } else if (fs::is_directory(arg)) {
+            for (const auto& entry : fs::recursive_directory_iterator(arg)) {
+                if (entry.is_regular_file()) paths.push_back(entry.path());
+            }
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.empty()) usage(argv[0]);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Sample> samples;
+    ShotMetrics total {};
+    usize shots = 0;
+
+    if (!quiet) {
+        printf("%-32s %6s %10s %10s %10s %10s %8s %8s %8s %8s\n", "shot", "time",
+               "p lag ms", "p noise dB", "t lag ms", "t noise dB", "t err", "heater", "pump", "chatter");
+    }
+    for (const fs::path& path : paths) {
+        if (!load_log(path, samples)) continue;
+        ShotMetrics m = replay(samples);
+        shots++;
+
+        total.duration += m.duration;
+        total.pressure.lag_ms += m.pressure.lag_ms;
+        total.pressure.noise_reduction_db += m.pressure.noise_reduction_db;
+        total.temperature.lag_ms += m.temperature.lag_ms;
+        total.temperature.noise_reduction_db += m.temperature.noise_reduction_db;
+        total.temp_mean_error += m.temp_mean_error;
+        total.heater_mean += m.heater_mean;
+        total.pump_mean += m.pump_mean;
+        total.pump_chatter += m.pump_chatter;
+
+        if (!quiet) {
+            printf("%-32s %6.1f %10.0f %10.1f %10.0f %10.1f %8.2f %8.2f %8.2f %8.3f\n",
+                   path.filename().c_str(), m.duration, m.pressure.lag_ms,
+                   m.pressure.noise_reduction_db, m.temperature.lag_ms,
+                   m.temperature.noise_reduction_db, m.temp_mean_error, m.heater_mean,
+                   m.pump_mean, m.pump_chatter);
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (shots == 0) {
+        printf("No readable brew logs\n");
+        return 1;
+    }
+    printf("%zu shots, averages: pressure lag %.0f ms, pressure noise -%.1f dB, "
+           "temp lag %.0f ms, temp noise -%.1f dB, temp error %.2f °C, heater %.2f, "
+           "pump %.2f, pump chatter %.3f\n",
+           shots, total.pressure.lag_ms / shots, total.pressure.noise_reduction_db / shots,
+           total.temperature.lag_ms / shots, total.temperature.noise_reduction_db / shots,
+           total.temp_mean_error / shots, total.heater_mean / shots, total.pump_mean / shots,
+           total.pump_chatter / shots);
+    printf("Replayed %.0f s of brewing in %.1f ms (%.0f logs/s)\n", total.duration,
+           elapsed * 1000, shots / elapsed);
+}
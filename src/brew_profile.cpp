@@ -0,0 +1,80 @@
+#include "brew_profile.hpp"
+#include <cstdio>
+#include <hardware/flash.h>
+#include <hardware/sync.h>
+#include "flash_journal.hpp"
+#include "network.hpp"
+#include "network/messages.hpp"
+#include "network/impl/serde.hpp"
+
+// Right after the settings journal
+constexpr auto PROFILE_FLASH_OFFSET = 1024 * 1024 + 4 * FLASH_SECTOR_SIZE;
+constexpr auto PROFILE_SECTORS = 2; // The older sector keeps a profile while the other is erased
+constexpr u32 PROFILE_VERSION = 1;
+
+static FlashJournal journal("Brew profile", PROFILE_FLASH_OFFSET, PROFILE_SECTORS, "GAGGICOP");
+
+static BrewProfile uploaded_profile;
+// What the running shot follows, uploads only change it with the next shot
+static BrewProfile shot_profile;
+// Updated on core 0 and flushed from core 1
+static volatile bool save_pending = false;
+
+void brew_profile::init() {
+    bool found = false;
+    FlashJournal::Record<BrewProfile> record;
+    for (u32 page = 0; page < journal.pages(); page++) {
+        if (!journal.read(page, PROFILE_VERSION, record) || !record.data.is_valid()) continue;
+        if (found && record.sequence <= journal.sequence()) continue;
+        found = true;
+        journal.found(page, record.sequence);
+        uploaded_profile = record.data;
+    }
+}
+
+const BrewProfile& brew_profile::start_shot() {
+    if (uploaded_profile.phase_count > 0) {
+        shot_profile = uploaded_profile;
+    } else {
+        shot_profile = BrewProfile::from_settings(settings::get());
+    }
+    return shot_profile;
+}
+
+const BrewProfile& brew_profile::uploaded() {
+    return uploaded_profile;
+}
+
+void brew_profile::update(const BrewProfile& profile) {
+    if (!profile.is_valid()) {
+        printf("Ignoring invalid brew profile\n");
+        return;
+    }
+    uploaded_profile = profile;
+    __dmb();
+    save_pending = true;
+
+    network::enqueue_message(BrewProfileMessage());
+}
+
+void brew_profile::flush() {
+    if (!save_pending) return;
+    // An upload racing the copy below sets this again and gets saved next
+    save_pending = false;
+    __dmb();
+    journal.append(PROFILE_VERSION, uploaded_profile);
+}
+
+void BrewProfile::write_data(u8*& ptr) const {
+    write_val(ptr, phase_count);
+    for (const ProfilePhase& phase : phases) {
+        write_struct(phase, ptr);
+    }
+}
+
+void BrewProfile::read_data(u8*& ptr) {
+    read_val(ptr, phase_count);
+    for (ProfilePhase& phase : phases) {
+        read_struct(phase, ptr);
+    }
+}
@@ -0,0 +1,148 @@
+#pragma once
+#include <algorithm>
+#include "inttypes.hpp"
+#include "settings.hpp"
+
+// What a phase controls, the other quantity is capped by the phase's limit
+enum class PhaseTarget : u8 {
+    Pressure,
+    Flow,
+};
+
+// Condition that ends a phase, besides its max_time
+enum class PhaseExit : u8 {
+    None, // Only max_time or the brew switch end the phase
+    Time,
+    Weight, // In the cup since the tare
+    Volume, // Pumped since the shot started
+    PressureAbove,
+    PressureBelow,
+    Count,
+};
+
+// One phase of a brew profile, in the fixed point units it is uploaded and
+// stored in. The target ramps linearly from start to end over ramp_time and
+// holds end afterwards.
+struct ProfilePhase {
+    static constexpr float PRESSURE_UNIT = 0.01; // bar
+    static constexpr float FLOW_UNIT = 0.01; // ml/s
+    static constexpr float TIME_UNIT = 0.1; // s
+    static constexpr float WEIGHT_UNIT = 0.1; // g
+    static constexpr float VOLUME_UNIT = 0.1; // ml
+    static constexpr float MAX_PRESSURE = 12; // bar, also caps a flow phase without a limit
+    static constexpr float MAX_FLOW = 10; // ml/s, about what the pump delivers without pressure
+
+    PhaseTarget target;
+    PhaseExit exit;
+    u16 start;
+    u16 end;
+    u16 ramp_time;
+    u16 limit; // Flow cap of a pressure phase or pressure cap of a flow phase, 0 for none
+    u16 exit_value; // In the unit of the exit condition
+    u16 max_time; // 0 for none
+
+    static constexpr u16 to_fixed(float value, float unit) {
+        return static_cast<u16>(std::clamp(value / unit + 0.5f, 0.f, 65535.f));
+    }
+
+    float target_unit() const {
+        return target == PhaseTarget::Pressure ? PRESSURE_UNIT : FLOW_UNIT;
+    }
+    u16 max_target() const {
+        return target == PhaseTarget::Pressure ? to_fixed(MAX_PRESSURE, PRESSURE_UNIT) : to_fixed(MAX_FLOW, FLOW_UNIT);
+    }
+    u16 max_limit() const {
+        return target == PhaseTarget::Pressure ? to_fixed(MAX_FLOW, FLOW_UNIT) : to_fixed(MAX_PRESSURE, PRESSURE_UNIT);
+    }
+
+    // Targets the machine can follow and an exit the phase can reach
+    bool is_valid() const {
+        if (target > PhaseTarget::Flow || exit >= PhaseExit::Count) return false;
+        if (start > max_target() || end > max_target() || limit > max_limit()) return false;
+        if (exit != PhaseExit::None && exit_value == 0) return false; // It would end right away
+        if (max_time > 0 && ramp_time > max_time) return false;
+
+        // Only max_time would end a phase that never gets to its pressure exit
+        u16 max_pressure = to_fixed(MAX_PRESSURE, PRESSURE_UNIT);
+        u16 highest = target == PhaseTarget::Pressure ? std::max(start, end) : limit > 0 ? limit : max_pressure;
+        u16 lowest = target == PhaseTarget::Pressure ? std::min(start, end) : 0;
+        switch (exit) {
+        case PhaseExit::Time: return ramp_time <= exit_value;
+        case PhaseExit::PressureAbove: return exit_value <= max_pressure && (max_time > 0 || exit_value <= highest);
+        case PhaseExit::PressureBelow: return exit_value <= max_pressure && (max_time > 0 || exit_value >= lowest);
+        default: return true;
+        }
+    }
+
+    float exit_unit() const {
+        switch (exit) {
+        case PhaseExit::Time: return TIME_UNIT;
+        case PhaseExit::Weight: return WEIGHT_UNIT;
+        case PhaseExit::Volume: return VOLUME_UNIT;
+        case PhaseExit::PressureAbove:
+        case PhaseExit::PressureBelow: return PRESSURE_UNIT;
+        default: return 0;
+        }
+    }
+};
+
+static_assert(sizeof(ProfilePhase) == 14, "Phases are stored as they are sent");
+
+constexpr usize MAX_PROFILE_PHASES = 8;
+
+struct BrewProfile {
+    static constexpr u32 DATA_SIZE = 4 + sizeof(ProfilePhase) * MAX_PROFILE_PHASES;
+
+    u32 phase_count = 0; // None runs the classic profile from the settings
+    ProfilePhase phases[MAX_PROFILE_PHASES] {};
+
+    bool is_valid() const {
+        if (phase_count > MAX_PROFILE_PHASES) return false;
+        for (u32 i = 0; i < phase_count; i++) {
+            if (!phases[i].is_valid()) return false;
+        }
+        return true;
+    }
+
+    // Preinfusion pressure for the preinfusion time, then brew pressure
+    // until the brew weight, like before profiles existed
+    static BrewProfile from_settings(const Settings& settings) {
+        BrewProfile profile;
+        auto pressure_phase = [](float pressure) {
+            ProfilePhase phase {};
+            phase.target = PhaseTarget::Pressure;
+            phase.start = phase.end = ProfilePhase::to_fixed(pressure, ProfilePhase::PRESSURE_UNIT);
+            return phase;
+        };
+        if (settings.preinfusion_time > 0) {
+            ProfilePhase& phase = profile.phases[profile.phase_count++];
+            phase = pressure_phase(settings.preinfusion_pressure);
+            phase.exit = PhaseExit::Time;
+            phase.exit_value = ProfilePhase::to_fixed(settings.preinfusion_time, ProfilePhase::TIME_UNIT);
+        }
+        ProfilePhase& phase = profile.phases[profile.phase_count++];
+        phase = pressure_phase(settings.brew_pressure);
+        if (settings.brew_weight > 0) {
+            phase.exit = PhaseExit::Weight;
+            phase.exit_value = ProfilePhase::to_fixed(settings.brew_weight, ProfilePhase::WEIGHT_UNIT);
+        }
+        return profile;
+    }
+
+    void write_data(u8*& ptr) const;
+    void read_data(u8*& ptr);
+};
+
+namespace brew_profile {
+void init();
+// Copy of the uploaded profile, or the classic one from the settings if there
+// is none, for a shot starting now. It stays as it is until the next shot.
+const BrewProfile& start_shot();
+// As uploaded, without phases when the classic profile runs
+const BrewProfile& uploaded();
+// Takes effect with the next shot, a profile without phases goes back to
+// the classic one
+void update(const BrewProfile& profile);
+// Called from core 1 like settings::flush
+void flush();
+}
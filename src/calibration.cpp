@@ -0,0 +1,59 @@
+#include "calibration.hpp"
+#include <hardware/flash.h>
+#include <hardware/sync.h>
+#include <pico/time.h>
+#include "flash_journal.hpp"
+#include "network.hpp"
+#include "network/messages.hpp"
+#include "network/impl/serde.hpp"
+
+// Right after the brew profile journal
+constexpr auto CALIBRATION_FLASH_OFFSET = 1024 * 1024 + 6 * FLASH_SECTOR_SIZE;
+constexpr auto CALIBRATION_SECTORS = 2;
+constexpr u32 CALIBRATION_VERSION = 1;
+constexpr u32 SAVE_INTERVAL_MS = 10 * 60 * 1000;
+
+static FlashJournal journal("Calibration", CALIBRATION_FLASH_OFFSET, CALIBRATION_SECTORS, "GAGGICOC");
+
+static Calibration current_calibration;
+// Updated on core 0 and flushed from core 1
+static volatile bool save_pending = false;
+static volatile absolute_time_t next_save_time = nil_time;
+
+void calibration::init() {
+    bool found = false;
+    FlashJournal::Record<Calibration> record;
+    for (u32 page = 0; page < journal.pages(); page++) {
+        if (!journal.read(page, CALIBRATION_VERSION, record)) continue;
+        if (found && record.sequence <= journal.sequence()) continue;
+        found = true;
+        journal.found(page, record.sequence);
+        current_calibration = record.data;
+    }
+}
+
+const Calibration& calibration::get() {
+    return current_calibration;
+}
+
+void calibration::update(const Calibration& new_calibration, bool save_now) {
+    current_calibration = new_calibration;
+    if (save_now) next_save_time = nil_time;
+    __dmb();
+    save_pending = true;
+
+    network::enqueue_message(CalibrationMessage());
+}
+
+void calibration::flush() {
+    if (!save_pending || !time_reached(next_save_time)) return;
+    // An update racing the copy below sets this again and gets saved next
+    save_pending = false;
+    __dmb();
+    journal.append(CALIBRATION_VERSION, current_calibration);
+    next_save_time = make_timeout_time_ms(SAVE_INTERVAL_MS);
+}
+
+void Calibration::write_data(u8*& ptr) const {
+    write_struct(*this, ptr);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include "control/tuning.hpp"
+#include "inttypes.hpp"
+
+// What the machine learns about itself. It is kept apart from the settings,
+// so the app can't overwrite it with the settings it sends.
+struct Calibration {
+    float pump_flow_gain = 1; // Scale on the datasheet flow per click, see FlowCalibration
+    float pump_zero_offset = 0; // ml/click, learned on top of the pump_zero setting
+    // Heater PID gains, found per machine by the autotune
+    float heater_kp = tuning::HEATER_PID.kP;
+    float heater_ki = tuning::HEATER_PID.kI;
+    float heater_kd = tuning::HEATER_PID.kD;
+    float drip_lag = 1; // s of the weight rate still dripping after the pump stops, see WeightStop
+
+    void write_data(u8*& ptr) const;
+};
+
+namespace calibration {
+void init();
+const Calibration& get();
+// `save_now` skips the save interval for results that took long to find
+void update(const Calibration& new_calibration, bool save_now = false);
+// Called from core 1 between shots. Every shot refines the calibration, so
+// it is written at most every SAVE_INTERVAL_MS to spare the flash and the
+// control pauses.
+void flush();
+}
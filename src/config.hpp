@@ -9,3 +9,10 @@
 #define COUNTRY_CODE CYW43_COUNTRY_SLOVAKIA
 
 #define MAINS_FREQUENCY_HZ 50
+
+// Boiler temperature sensor: Max6675, Max31855 or Max31865<> for a PT100,
+// Max31865<true> if it is a three wire one
+#define TEMP_SENSOR Max6675
+
+// Time between temperature reads, no shorter than the sensor's conversion time
+#define TEMP_READ_INTERVAL_MS 250
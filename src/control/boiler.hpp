@@ -0,0 +1,14 @@
+#pragma once
+#include "control/control.hpp"
+
+// Energy balance of the boiler, used to feed the heater forward while the
+// pump pushes cold water into it, long before the thermocouple sees the drop
+constexpr float HEATER_POWER_W = 1050;
+constexpr float WATER_HEAT_CAPACITY_J_PER_ML_K = 4.186;
+constexpr float INLET_TEMP = 22; // Tank water is assumed to be at room temperature
+
+// Share of the heater power that heats the incoming water to boiler temperature
+constexpr float get_heater_feedforward(float flow, float boiler_temp) {
+    if (flow <= 0 || boiler_temp <= INLET_TEMP) return 0;
+    return flow * WATER_HEAT_CAPACITY_J_PER_ML_K * (boiler_temp - INLET_TEMP) / HEATER_POWER_W;
+}
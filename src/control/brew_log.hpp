@@ -0,0 +1,14 @@
+#pragma once
+#include "control/control.hpp"
+#include "inttypes.hpp"
+
+// Brew logs start with the version, followed by a BrewLog record
+// every 100 ms
+constexpr i32 BREW_LOG_VERSION = 6;
+
+struct BrewLog {
+    float time;
+    control::Sensors sensors;
+    control::HeaterOutput heater;
+    bool steam_switch_pressed;
+};
@@ -1,21 +1,33 @@
 #include "control.hpp"
+#include <iterator>
 #include <pico/time.h>
 #include "hardware/timer.h"
+#include "impl/coroutine.hpp"
 #include "impl/kalman_filter.hpp"
 #include "impl/pid.hpp"
+#include "impl/seqlock.hpp"
 #include "hardware/hardware.hpp"
+#include "boiler.hpp"
+#include "calibration.hpp"
 #include "pump.hpp"
 #include "protocol.hpp"
+#include "settings.hpp"
+#include "tuning.hpp"
+#include "weight_stop.hpp"
 using namespace control;
 
 Sensors _sensors;
+static SeqLock<SensorSnapshot> published_sensors;
 
 // Sensor update vars
-static SimpleKalmanFilter pressure_filter(0.6, 0.6, 0.1);
-static SimpleKalmanFilter temp_filter(0.5, 0.5, 0.3);
-static absolute_time_t pressure_read_timeout = nil_time;
-static absolute_time_t flow_update_timeout = nil_time;
-static absolute_time_t temp_read_timeout = nil_time;
+static SimpleKalmanFilter<tuning::Number> pressure_filter(tuning::PRESSURE_FILTER.err_measure,
+                                                          tuning::PRESSURE_FILTER.err_estimate,
+                                                          tuning::PRESSURE_FILTER.q);
+static SimpleKalmanFilter<tuning::Number> temp_filter(tuning::TEMP_FILTER.err_measure,
+                                                      tuning::TEMP_FILTER.err_estimate,
+                                                      tuning::TEMP_FILTER.q);
+static absolute_time_t last_pressure_time = nil_time;
+static absolute_time_t last_temp_time = nil_time;
 static absolute_time_t close_enough_time = nil_time;
 static bool last_close_enough = false;
 
@@ -27,23 +39,77 @@ static bool blink_light_on = false;
 // Update vars
 static bool heater_enabled = false;
 static bool pump_enabled = false;
-static absolute_time_t heater_update_timeout = nil_time;
 static float target_pressure;
+static PressureController pressure_controller;
+static FlowCalibration flow_calibration;
+static WeightStop weight_stop;
 static float target_flow = 999999;
-static PID heater_pid(0.087, 0.00383, 0.49416, 0, 1);
+static HeaterOutput heater_output {0, 0};
+static PID<tuning::Number> heater_pid(tuning::HEATER_PID.kP, tuning::HEATER_PID.kI, tuning::HEATER_PID.kD, 0, 1);
+static HeaterGains heater_gains = HeaterGains::Standby;
+
+// Heater metrics vars
+constexpr float SETTLE_BAND = 0.5;
+constexpr u32 SETTLE_HOLD_MS = 10'000;
+static HeaterMetrics heater_metrics {HeaterGains::Standby, 0, 0, -1};
+static absolute_time_t heater_step_time = nil_time;
+static absolute_time_t heater_band_time = nil_time;
+static float heater_step_direction = 1;
+
+static_assert(std::size(tuning::HEATER_GAIN_SCALES) == static_cast<usize>(HeaterGains::Count),
+              "Every heater gain set needs its factors");
+
+static void apply_heater_gains() {
+    const Calibration& c = calibration::get();
+    const tuning::PIDParams& scale = tuning::HEATER_GAIN_SCALES[static_cast<usize>(heater_gains)];
+    heater_pid.set_params(c.heater_kp * scale.kP, c.heater_ki * scale.kI, c.heater_kd * scale.kD);
+    heater_metrics.gains = heater_gains;
+}
+
+static void start_heater_step() {
+    float target = static_cast<float>(heater_pid.get_target());
+    heater_metrics = {heater_gains, target, 0, -1};
+    heater_step_time = get_absolute_time();
+    heater_band_time = nil_time;
+    heater_step_direction = target >= _sensors.temperature ? 1 : -1;
+}
+
+static void update_heater_metrics(float temp) {
+    float error = temp - heater_metrics.target;
+    heater_metrics.overshoot = fmaxf(heater_metrics.overshoot, error * heater_step_direction);
+
+    if (fabsf(error) > SETTLE_BAND) {
+        heater_band_time = nil_time;
+        heater_metrics.settling_time = -1;
+        return;
+    }
+    absolute_time_t now = get_absolute_time();
+    if (heater_band_time == nil_time) {
+        heater_band_time = now;
+    }
+    if (heater_metrics.settling_time < 0 &&
+        absolute_time_diff_us(heater_band_time, now) >= SETTLE_HOLD_MS * 1000) {
+        heater_metrics.settling_time = absolute_time_diff_us(heater_step_time, heater_band_time) / 1e6f;
+    }
+}
 
 void control::set_boiler_enabled(bool enabled) {
     heater_enabled = enabled;
     if (enabled) {
+        apply_heater_gains();
         heater_pid.reset(_sensors.temperature);
+        start_heater_step();
     } else {
         hardware::set_heater(0);
+        heater_output = {0, 0};
     }
 }
 
 void control::set_pump_enabled(bool enabled) {
     pump_enabled = enabled;
-    if (!enabled) {
+    if (enabled) {
+        pressure_controller.reset(_sensors.pressure);
+    } else {
         hardware::set_pump(0);
     }
 }
@@ -56,7 +122,39 @@ void control::set_target_flow(float flow) {
 }
 
 void control::set_target_temperature(float temperature) {
+    bool changed = static_cast<float>(heater_pid.get_target()) != temperature;
     heater_pid.set_target(temperature);
+    if (changed) {
+        start_heater_step();
+    }
+}
+
+void control::set_heater_gains(HeaterGains gains) {
+    if (gains == heater_gains) return;
+    heater_gains = gains;
+    apply_heater_gains();
+    start_heater_step();
+}
+
+void control::set_flow_calibration(bool enabled) {
+    if (enabled == flow_calibration.is_running()) return;
+    if (enabled) {
+        flow_calibration.start();
+    } else {
+        flow_calibration.finish();
+    }
+}
+
+float control::drip_estimate() {
+    return weight_stop.drip();
+}
+
+void control::set_weight_stopped(float target_weight) {
+    weight_stop.stopped(_sensors.weight, target_weight);
+}
+
+const WeightLanding& control::weight_landing() {
+    return weight_stop.landing();
 }
 
 void control::set_light_blink(u32 delay_ms) {
@@ -67,58 +165,73 @@ void control::set_light_blink(u32 delay_ms) {
 }
 
 void control::reset() {
-    pressure_filter.reset(hardware::read_pressure());
-    temp_filter.reset(hardware::read_temp());
+    pressure_filter.reset(hardware::read_pressure().pressure);
+    temp_filter.reset(hardware::read_temp().temperature);
     heater_pid.reset(_sensors.temperature);
 }
 
-void control::update_sensors() {
-    if (time_reached(pressure_read_timeout)) {
-        float raw_pressure = hardware::read_pressure();
-        _sensors.pressure = pressure_filter.update(raw_pressure);
-        pressure_read_timeout = make_timeout_time_ms(10);
-    }
-
-    if (time_reached(temp_read_timeout)) {
-        float raw_temp = hardware::read_temp();
-        _sensors.temperature = temp_filter.update(raw_temp);
-        temp_read_timeout = make_timeout_time_ms(250);
-    }
-
-    if (time_reached(flow_update_timeout)) {
-        _sensors.pump_clicks = hardware::get_and_reset_pump_clicks();
-        float flow_per_100ms = get_flow(_sensors.pressure, _sensors.pump_clicks);
-        _sensors.total_flow += flow_per_100ms;
-        _sensors.flow = flow_per_100ms * 10; // Calculate flow in ml/s
-        flow_update_timeout = make_timeout_time_ms(100);
-    }
-
+void control::update_pressure() {
     _sensors.weight = hardware::read_weight();
+
+    hardware::PressureSample sample = hardware::read_pressure();
+    if (sample.time == last_pressure_time) return; // Don't filter the same sample twice
+    last_pressure_time = sample.time;
+    _sensors.raw_pressure = sample.pressure;
+    _sensors.pressure = static_cast<float>(pressure_filter.update(sample.pressure));
+    Coroutine::wake(Coroutine::PRESSURE_UPDATE);
 }
 
-void control::update() {
-    if (heater_enabled && time_reached(heater_update_timeout)) {
-        heater_update_timeout = make_timeout_time_ms(250);
+void control::update_temperature() {
+    hardware::TempSample sample = hardware::read_temp();
+    if (sample.time == last_temp_time) return; // Don't filter the same sample twice
+    last_temp_time = sample.time;
+    _sensors.raw_temperature = sample.temperature;
+    _sensors.temperature = static_cast<float>(temp_filter.update(sample.temperature));
+    Coroutine::wake(Coroutine::TEMP_UPDATE);
+}
 
-        float curr_temp = _sensors.temperature;
+void control::update_flow() {
+    _sensors.pump_clicks = hardware::get_and_reset_pump_clicks();
+    float flow_per_period = get_flow(_sensors.pressure, _sensors.pump_clicks);
+    _sensors.total_flow += flow_per_period;
+    _sensors.flow = flow_per_period * FLOW_RATE_HZ; // Calculate flow in ml/s
+    flow_calibration.update(_sensors);
+    weight_stop.update(_sensors);
+    Coroutine::wake(Coroutine::FLOW_UPDATE);
+}
 
-        float heater_value = heater_pid.update(curr_temp);
-        hardware::set_heater(heater_value);
+void control::update_heater() {
+    if (!heater_enabled) return;
+
+    float curr_temp = _sensors.temperature;
+    float target = static_cast<float>(heater_pid.get_target());
+    update_heater_metrics(curr_temp);
+
+    // The pump clicks show the incoming water right away, the PID only
+    // corrects what the feedforward misses
+    float feedforward = fminf(get_heater_feedforward(_sensors.flow, curr_temp), 1);
+    heater_pid.set_output_limits(0, 1 - feedforward);
+    float heater_value = static_cast<float>(heater_pid.update(curr_temp)) + feedforward;
+    hardware::set_heater(heater_value);
+    heater_output = {heater_value, feedforward};
+
+    bool temp_close_enough = fabs(target - curr_temp) < 1;
+    if (temp_close_enough != last_close_enough) {
+        last_close_enough = temp_close_enough;
+        close_enough_time = make_timeout_time_ms(30000);
+    }
 
-        bool temp_close_enough = fabs(heater_pid.get_target() - curr_temp) < 1;
-        if (temp_close_enough != last_close_enough) {
-            last_close_enough = temp_close_enough;
-            close_enough_time = make_timeout_time_ms(30000);
-        }
+    hardware::set_light(hardware::Brew, temp_close_enough && time_reached(close_enough_time));
+}
 
-        hardware::set_light(hardware::Brew, temp_close_enough && time_reached(close_enough_time));
-    }
+void control::update_pump() {
+    if (!pump_enabled) return;
 
-    if (pump_enabled) {
-        float pump_value = calculate_desired_power(_sensors, target_pressure, target_flow);
-        hardware::set_pump(pump_value);
-    }
+    float pump_value = pressure_controller.update(_sensors, target_pressure, target_flow);
+    hardware::set_pump(pump_value);
+}
 
+void control::update_lights() {
     if (blink_light_period > 0 && time_reached(blink_timeout)) {
         blink_light_on = !blink_light_on;
         hardware::set_light(hardware::Steam, blink_light_on);
@@ -129,3 +242,11 @@ void control::update() {
 const Sensors& control::sensors() {
     return _sensors;
 }
+
+void control::publish_sensors() {
+    published_sensors.write({_sensors, heater_output, heater_metrics, get_absolute_time()});
+}
+
+SensorSnapshot control::sensors_snapshot() {
+    return published_sensors.read();
+}
@@ -1,7 +1,19 @@
 #pragma once
 
+#include <pico/time.h>
+#include "config.hpp"
 #include "inttypes.hpp"
 namespace control {
+// Rates at which the scheduler runs the update functions below
+constexpr u32 PRESSURE_RATE_HZ = 100;
+constexpr u32 TEMP_RATE_HZ = 1000 / TEMP_READ_INTERVAL_MS;
+static_assert(TEMP_READ_INTERVAL_MS <= 1000 && 1000 % TEMP_READ_INTERVAL_MS == 0,
+              "The temperature interval must divide a second");
+constexpr u32 FLOW_RATE_HZ = 10;
+constexpr u32 HEATER_RATE_HZ = 4;
+constexpr u32 PUMP_RATE_HZ = 100;
+constexpr u32 LIGHTS_RATE_HZ = 20;
+
 struct Sensors {
     float pressure;
     float temperature;
@@ -9,6 +21,43 @@ struct Sensors {
     float flow;
     u32 pump_clicks;
     float total_flow = 0;
+    float raw_pressure;
+    float raw_temperature;
+};
+
+struct HeaterOutput {
+    float power;
+    float feedforward; // Share of the power from the boiler energy balance
+};
+
+// Heater PID gain sets, as factors on the autotuned gains from the settings
+enum class HeaterGains : u32 {
+    Standby,
+    Brew,
+    Count,
+};
+
+// Heater response since the last change of its target or gain set
+struct HeaterMetrics {
+    HeaterGains gains;
+    float target;
+    float overshoot; // Furthest past the target in the direction of the step
+    float settling_time; // Seconds until it stayed within the band, negative until then
+};
+
+// Where the cup settled after the last shot that stopped with the scale tared
+struct WeightLanding {
+    float target; // 0 for shots without a target weight
+    float weight;
+    float error;
+    float drip_lag; // Learned from this shot, see WeightStop
+};
+
+struct SensorSnapshot {
+    Sensors sensors;
+    HeaterOutput heater;
+    HeaterMetrics heater_metrics;
+    absolute_time_t time;
 };
 
 void set_boiler_enabled(bool enabled);
@@ -16,9 +65,27 @@ void set_pump_enabled(bool enabled);
 void set_target_pressure(float pressure);
 void set_target_flow(float pressure);
 void set_target_temperature(float temperature);
+void set_heater_gains(HeaterGains gains);
+// Fits the pump flow model to the scale while enabled, disabling stores the fit
+void set_flow_calibration(bool enabled);
+// Weight expected to drip into the cup if the pump stopped now
+float drip_estimate();
+// Follows the cup until it settles after the pump stopped, reports where it
+// landed and learns the drip lag from it
+void set_weight_stopped(float target_weight);
+const WeightLanding& weight_landing();
 void set_light_blink(u32 delay_ms);
 void reset();
-void update();
-void update_sensors();
+void update_pressure();
+void update_temperature();
+void update_flow();
+void update_heater();
+void update_pump();
+void update_lights();
 const Sensors& sensors();
+
+// Publishes the sensor values for the other core, called once per main loop pass
+void publish_sensors();
+// Consistent copy of the last published sensor values, safe to call from core 1
+SensorSnapshot sensors_snapshot();
 }
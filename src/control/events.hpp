@@ -0,0 +1,87 @@
+#pragma once
+#include "control/control.hpp"
+#include "control/impl/coroutine.hpp"
+#include "hardware/hardware.hpp"
+
+// Awaitables on sensor values and switches for the state coroutines. Each
+// one is only checked after the update that can change it.
+
+// Sensor value past a threshold, made by the helpers below
+struct sensor_threshold : Event<sensor_threshold> {
+    float control::Sensors::* sensor;
+    float threshold;
+    bool above;
+    u8 update;
+
+    u8 wake_on() const { return update; }
+    bool ready() const {
+        float value = control::sensors().*sensor;
+        return above ? value > threshold : value < threshold;
+    }
+};
+
+inline sensor_threshold pressure_above(float bar) {
+    return {{}, &control::Sensors::pressure, bar, true, Coroutine::PRESSURE_UPDATE};
+}
+inline sensor_threshold pressure_below(float bar) {
+    return {{}, &control::Sensors::pressure, bar, false, Coroutine::PRESSURE_UPDATE};
+}
+inline sensor_threshold temperature_above(float celsius) {
+    return {{}, &control::Sensors::temperature, celsius, true, Coroutine::TEMP_UPDATE};
+}
+inline sensor_threshold weight_above(float grams) {
+    return {{}, &control::Sensors::weight, grams, true, Coroutine::PRESSURE_UPDATE};
+}
+
+// Pressure crossing `bar` in either direction from where it is now
+struct pressure_crosses : Event<pressure_crosses> {
+    float level;
+    bool started_above;
+
+    explicit pressure_crosses(float bar): level(bar), started_above(control::sensors().pressure > bar) {}
+
+    u8 wake_on() const { return Coroutine::PRESSURE_UPDATE; }
+    bool ready() const { return (control::sensors().pressure > level) != started_above; }
+};
+
+// Pressure that hasn't risen for `hold_ms`, it peaked or levelled off
+struct pressure_peak : Event<pressure_peak> {
+    float peak;
+    u64 peak_us;
+    u64 hold_us;
+
+    explicit pressure_peak(u32 hold_ms)
+        : peak(control::sensors().pressure), peak_us(time_us_64()), hold_us(hold_ms * 1000ull) {}
+
+    u8 wake_on() const { return Coroutine::PRESSURE_UPDATE; }
+    bool ready() {
+        float pressure = control::sensors().pressure;
+        u64 now = time_us_64();
+        if (pressure > peak) {
+            peak = pressure;
+            peak_us = now;
+        }
+        return now - peak_us >= hold_us;
+    }
+};
+
+// Debounced edge of a switch, either direction
+struct switch_changed : Event<switch_changed> {
+    hardware::Switch which;
+    bool initial;
+
+    explicit switch_changed(hardware::Switch which): which(which), initial(hardware::get_switch(which)) {}
+
+    u8 wake_on() const { return Coroutine::SWITCH_CHANGE; }
+    bool ready() const { return hardware::get_switch(which) != initial; }
+};
+
+struct switch_is : Event<switch_is> {
+    hardware::Switch which;
+    bool state;
+
+    switch_is(hardware::Switch which, bool state): which(which), state(state) {}
+
+    u8 wake_on() const { return Coroutine::SWITCH_CHANGE; }
+    bool ready() const { return hardware::get_switch(which) == state; }
+};
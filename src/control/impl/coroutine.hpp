@@ -3,14 +3,54 @@
 #include "inttypes.hpp"
 #include "panic.hpp"
 #include <pico/time.h>
+#include <algorithm>
 #include <coroutine>
+#include <tuple>
 
-struct Awaiter;
-
+// The coroutines of the current state run as tasks out of a fixed pool of
+// frames. Calling a coroutine function starts a task, the state's own
+// coroutine is just the first one. Tasks are resumed round robin and all
+// of them are destroyed when the state is left.
+//
+// A waiting task says in its frame what can wake it: a time, the sensor
+// updates or switch changes its awaitable depends on, or every pass. A pass
+// only checks the awaitables something woke.
 struct Coroutine {
-    static inline char buffer[256];
-    static inline bool has_coroutine = false;
-    static inline Awaiter* curr_awaiter = nullptr;
+    // `gaggico_sim --check-frames` prints the frames of the states and the
+    // tasks they spawn and runs after every sim build. Those are host frames,
+    // the arm-none-eabi ones aren't measured, so on the machine only the
+    // COROUTINE_TOO_BIG panic guards this size.
+    static constexpr usize FRAME_SIZE = 192;
+    static constexpr usize FRAME_COUNT = 4;
+
+    // What a frame waits for. The updates and switch changes are raised
+    // with wake().
+    static constexpr u8 PRESSURE_UPDATE = 1 << 0; // Pressure and weight
+    static constexpr u8 TEMP_UPDATE = 1 << 1;
+    static constexpr u8 FLOW_UPDATE = 1 << 2;
+    static constexpr u8 SWITCH_CHANGE = 1 << 3;
+    static constexpr u8 EVERY_PASS = 1 << 6;
+    static constexpr u8 TIMER = 1 << 7;
+    static constexpr u64 NO_DEADLINE = UINT64_MAX;
+
+    // Zero initialized as a static, so free and waiting for nothing
+    struct Frame {
+        alignas(8) char buffer[FRAME_SIZE];
+        bool used;
+        u8 wake_on;
+        u64 resume_us; // With TIMER
+        // Checked once woken, null resumes right away. The awaitable lives
+        // in the buffer until the task is resumed.
+        bool (*ready)(void* awaitable);
+        void* awaitable;
+    };
+    static inline Frame frames[FRAME_COUNT];
+    // Largest frame asked for so far, including one that didn't fit
+    static inline usize largest_frame = 0;
+    // Earliest resume time of the frames waiting on TIMER
+    static inline u64 next_timer_us = NO_DEADLINE;
+    static inline u8 pending_wakes = 0;
+
     struct Promise {
         Coroutine get_return_object() noexcept { return {}; }
         std::suspend_always initial_suspend() noexcept { return {}; }
@@ -19,34 +59,103 @@ struct Coroutine {
         void return_void() noexcept {}
 
         void* operator new(usize len) {
-            if (len > sizeof(buffer)) {
+            if (len > largest_frame) largest_frame = len;
+            if (len > FRAME_SIZE) {
                 panic(Error::COROUTINE_TOO_BIG);
             }
-            has_coroutine = true;
-            return buffer;
+            for (Frame& frame : frames) {
+                if (frame.used) continue;
+                frame.used = true;
+                frame.wake_on = EVERY_PASS;
+                frame.ready = nullptr;
+                return frame.buffer;
+            }
+            panic(Error::COROUTINE_POOL_FULL);
         }
-        void operator delete(void*) {
-            has_coroutine = false;
-            curr_awaiter = nullptr;
+        void operator delete(void* ptr) {
+            Frame& frame = frame_of(ptr);
+            frame.used = false;
+            frame.wake_on = 0;
         }
     };
 
     using promise_type = Promise;
     using Handle = std::coroutine_handle<Promise>;
 
-    static Handle handle() { return Handle::from_address(buffer); }
-};
+    // The frame's buffer is its first member, so a handle's address is
+    // the address of its frame
+    static Frame& frame_of(void* address) {
+        return *reinterpret_cast<Frame*>(address);
+    }
+
+    static usize task_count() {
+        usize count = 0;
+        for (const Frame& frame : frames) {
+            count += frame.used;
+        }
+        return count;
+    }
 
-struct Awaiter {
-    virtual bool should_resume() = 0;
-    void await_suspend(Coroutine::Handle) {
-        Coroutine::curr_awaiter = this;
+    // Parks the task on an Event until it is woken and ready
+    template<typename E>
+    static void wait(Handle handle, E& event) {
+        Frame& frame = frame_of(handle.address());
+        u64 deadline = event.deadline_us();
+        frame.wake_on = event.wake_on() | (deadline != NO_DEADLINE ? TIMER : 0);
+        frame.resume_us = deadline;
+        frame.ready = [](void* awaitable) { return static_cast<E*>(awaitable)->ready(); };
+        frame.awaitable = &event;
+        if (deadline < next_timer_us) next_timer_us = deadline;
     }
-    void await_resume() {
-        Coroutine::curr_awaiter = nullptr;
+
+    // Called by the sensor updates and the main loop, the awaitables
+    // waiting on them are checked in the next pass
+    static void wake(u8 updates) {
+        pending_wakes |= updates;
     }
+
+    static void resume_all();
+    static void destroy_all();
 };
 
+// Resumes every task that is ready, a task started meanwhile gets its
+// first resume in the same pass if it landed in a later frame
+inline void Coroutine::resume_all() {
+    u8 woken = pending_wakes | EVERY_PASS;
+    pending_wakes = 0;
+    if (next_timer_us != NO_DEADLINE && time_us_64() >= next_timer_us) woken |= TIMER;
+
+    for (Frame& frame : frames) {
+        if (!(frame.wake_on & woken)) continue;
+        if (frame.ready && !frame.ready(frame.awaitable)) continue;
+
+        frame.wake_on = EVERY_PASS;
+        frame.ready = nullptr;
+        Handle handle = Handle::from_address(frame.buffer);
+        handle.resume();
+        if (handle.done()) {
+            handle.destroy();
+        }
+    }
+
+    if (woken & TIMER) {
+        next_timer_us = NO_DEADLINE;
+        for (const Frame& frame : frames) {
+            if ((frame.wake_on & TIMER) && frame.resume_us < next_timer_us) next_timer_us = frame.resume_us;
+        }
+    }
+}
+
+inline void Coroutine::destroy_all() {
+    for (Frame& frame : frames) {
+        if (frame.used) {
+            Handle::from_address(frame.buffer).destroy();
+        }
+    }
+    next_timer_us = NO_DEADLINE;
+    pending_wakes = 0;
+}
+
 struct next_cycle_t {
     bool await_ready() const { return false; }
     void await_suspend(Coroutine::Handle) const {}
@@ -54,19 +163,98 @@ struct next_cycle_t {
 };
 constexpr next_cycle_t next_cycle {};
 
-struct delay_ms : Awaiter {
-    absolute_time_t resume_time;
-    explicit delay_ms(u32 ms): resume_time(make_timeout_time_ms(ms)) {}
+// Base of the awaitables a task can wait on. `Self` has a ready() check and
+// can narrow when it is made, by the wake bits it depends on and a deadline.
+// Events may keep state in ready(), like an edge that was seen, so they
+// are awaited once.
+template<typename Self>
+struct Event {
+    u8 wake_on() const { return Coroutine::EVERY_PASS; }
+    u64 deadline_us() const { return Coroutine::NO_DEADLINE; }
+
+    bool await_ready() { return self().ready(); }
+    void await_suspend(Coroutine::Handle handle) { Coroutine::wait(handle, self()); }
+    void await_resume() const {}
+
+private:
+    Self& self() { return static_cast<Self&>(*this); }
+};
+
+struct delay_ms : Event<delay_ms> {
+    u64 resume_us;
+    explicit delay_ms(u32 ms): resume_us(time_us_64() + ms * 1000ull) {}
 
-    bool should_resume() { return time_reached(resume_time); }
-    bool await_ready() { return should_resume(); }
+    u8 wake_on() const { return 0; }
+    u64 deadline_us() const { return resume_us; }
+    bool ready() const { return time_us_64() >= resume_us; }
 };
 
-struct predicate : Awaiter {
+// Waits until `pred` is true. By default it is checked on every pass, a
+// predicate on sensor values only needs to be checked after their update.
+struct predicate : Event<predicate> {
     bool(*pred)();
+    u8 wake_bits;
+
+    explicit predicate(bool(*pred)(), u8 wake_on = Coroutine::EVERY_PASS): pred(pred), wake_bits(wake_on) {}
+
+    u8 wake_on() const { return wake_bits; }
+    bool ready() const { return pred(); }
+};
+
+// Waits for the first of the events and returns its index
+template<typename... E>
+struct when_any : Event<when_any<E...>> {
+    std::tuple<E...> events;
+    i32 fired = -1;
+
+    explicit when_any(E... events): events(events...) {}
+
+    u8 wake_on() const {
+        return std::apply([](const E&... e) { return static_cast<u8>((e.wake_on() | ...)); }, events);
+    }
+    u64 deadline_us() const {
+        return std::apply([](const E&... e) { return std::min({e.deadline_us()...}); }, events);
+    }
+    bool ready() {
+        i32 i = 0;
+        std::apply([&](E&... e) { ((e.ready() ? (fired = i, true) : (i++, false)) || ...); }, events);
+        return fired >= 0;
+    }
+    i32 await_resume() const { return fired; }
+};
+
+// Waits until all events happened, each one counts once it was ready
+template<typename... E>
+struct when_all : Event<when_all<E...>> {
+    std::tuple<E...> events;
+    u32 done = 0;
+
+    explicit when_all(E... events): events(events...) {}
+
+    u8 wake_on() const {
+        return std::apply([](const E&... e) { return static_cast<u8>((e.wake_on() | ...)); }, events);
+    }
+    u64 deadline_us() const {
+        return std::apply([&](const E&... e) {
+            u64 deadline = Coroutine::NO_DEADLINE;
+            u32 bit = 1;
+            ((deadline = !(done & bit) ? std::min(deadline, e.deadline_us()) : deadline, bit <<= 1), ...);
+            return deadline;
+        }, events);
+    }
+    bool ready() {
+        std::apply([&](E&... e) {
+            u32 bit = 1;
+            ((done |= !(done & bit) && e.ready() ? bit : 0, bit <<= 1), ...);
+        }, events);
+        return done == (1u << sizeof...(E)) - 1;
+    }
+};
 
-    explicit predicate(bool(*pred)()): pred(pred) {}
+// Waits for `event` for at most `ms`, returns whether it happened
+template<typename E>
+struct with_timeout : when_any<E, delay_ms> {
+    with_timeout(E event, u32 ms): when_any<E, delay_ms>(event, delay_ms(ms)) {}
 
-    bool should_resume() { return pred(); }
-    bool await_ready() { return pred(); }
+    bool await_resume() const { return this->fired == 0; }
 };
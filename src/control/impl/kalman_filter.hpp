@@ -5,31 +5,33 @@
  */
 #pragma once
 
-#include <cmath>
+#include "numeric.hpp"
+
+template<typename T = float>
 class SimpleKalmanFilter {
-    float err_measure;
-    float err_estimate;
-    float init_err_estimate;
-    float q;
-    float last_estimate = 0;
+    T err_measure;
+    T err_estimate;
+    T init_err_estimate;
+    T q;
+    T last_estimate = 0;
 
 public:
-    SimpleKalmanFilter(float err_measure, float err_estimate, float q):
+    SimpleKalmanFilter(T err_measure, T err_estimate, T q):
         err_measure(err_measure),
         err_estimate(err_estimate),
         init_err_estimate(err_estimate),
         q(q) {}
 
-    float update(float value) {
-        float kalman_gain = err_estimate / (err_estimate + err_measure);
-        float current_estimate = last_estimate + kalman_gain*(value - last_estimate);
-        err_estimate = (1 - kalman_gain)*err_estimate + std::abs(last_estimate - current_estimate)*q;
+    T update(T value) {
+        T kalman_gain = err_estimate / (err_estimate + err_measure);
+        T current_estimate = last_estimate + kalman_gain*(value - last_estimate);
+        err_estimate = (T(1) - kalman_gain)*err_estimate + Numeric<T>::abs(last_estimate - current_estimate)*q;
         last_estimate = current_estimate;
 
         return current_estimate;
     }
 
-    void reset(float value) {
+    void reset(T value) {
         last_estimate = value;
         err_estimate = init_err_estimate;
     }
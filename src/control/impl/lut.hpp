@@ -0,0 +1,46 @@
+#pragma once
+#include <array>
+#include "inttypes.hpp"
+
+// Linearly interpolated table of a function over [x_min, x_max], generated
+// at compile time so it ends up in flash. Inputs outside the range are
+// clamped to it.
+template<usize N>
+class LookupTable {
+    static_assert(N >= 2, "A lookup table needs at least two points");
+
+    float x_min;
+    float step;
+    float inv_step;
+    std::array<float, N> y {};
+
+public:
+    template<typename F>
+    constexpr LookupTable(F f, float x_min, float x_max)
+        : x_min(x_min), step((x_max - x_min) / (N - 1)), inv_step((N - 1) / (x_max - x_min)) {
+        for (usize i = 0; i < N; i++) {
+            y[i] = f(x_min + step * i);
+        }
+    }
+
+    constexpr float operator()(float x) const {
+        float position = (x - x_min) * inv_step;
+        if (position <= 0) return y[0];
+        if (position >= N - 1) return y[N - 1];
+        usize i = static_cast<usize>(position);
+        float t = position - static_cast<float>(i);
+        return y[i] + (y[i + 1] - y[i]) * t;
+    }
+
+    // Largest difference to f, checked at `substeps` points per table step
+    template<typename F>
+    constexpr float max_error(F f, u32 substeps) const {
+        float error = 0;
+        for (usize i = 0; i < (N - 1) * substeps + 1; i++) {
+            float x = x_min + step * i / substeps;
+            float diff = (*this)(x) - f(x);
+            error = diff > error ? diff : -diff > error ? -diff : error;
+        }
+        return error;
+    }
+};
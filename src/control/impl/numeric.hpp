@@ -0,0 +1,105 @@
+#pragma once
+#include <cstdint>
+#include "inttypes.hpp"
+
+// Signed fixed point number with FRAC_BITS fractional bits stored in an i32.
+// All arithmetic saturates instead of wrapping around, dividing by zero
+// saturates towards the sign of the dividend. Products are rounded to
+// nearest, truncating them would let the Kalman filter's slowly shrinking
+// estimate error collapse to zero and freeze the filter.
+template<int FRAC_BITS>
+struct Fixed {
+    static_assert(FRAC_BITS > 0 && FRAC_BITS < 31, "Fixed needs integer and fractional bits");
+    static constexpr i32 ONE = 1 << FRAC_BITS;
+
+    i32 raw = 0;
+
+    constexpr Fixed() = default;
+    constexpr Fixed(float value) : raw(from_float(value)) {}
+
+    static constexpr Fixed from_raw(i32 raw) {
+        Fixed result;
+        result.raw = raw;
+        return result;
+    }
+
+    static constexpr Fixed from_ratio(i64 num, i64 den) {
+        if (den == 0) return from_raw(num < 0 ? INT32_MIN : INT32_MAX);
+        return from_raw(saturate(num * ONE / den));
+    }
+
+    static constexpr Fixed max() { return from_raw(INT32_MAX); }
+    static constexpr Fixed min() { return from_raw(INT32_MIN); }
+
+    constexpr explicit operator float() const {
+        return static_cast<float>(raw) / ONE;
+    }
+
+    constexpr Fixed operator-() const {
+        return from_raw(saturate(-static_cast<i64>(raw)));
+    }
+    constexpr Fixed operator+(Fixed other) const {
+        return from_raw(saturate(static_cast<i64>(raw) + other.raw));
+    }
+    constexpr Fixed operator-(Fixed other) const {
+        return from_raw(saturate(static_cast<i64>(raw) - other.raw));
+    }
+    constexpr Fixed operator*(Fixed other) const {
+        i64 product = static_cast<i64>(raw) * other.raw;
+        return from_raw(saturate((product + (1 << (FRAC_BITS - 1))) >> FRAC_BITS));
+    }
+    constexpr Fixed operator/(Fixed other) const {
+        if (other.raw == 0) return from_raw(raw < 0 ? INT32_MIN : INT32_MAX);
+        return from_raw(saturate((static_cast<i64>(raw) << FRAC_BITS) / other.raw));
+    }
+
+    constexpr Fixed& operator+=(Fixed other) { return *this = *this + other; }
+    constexpr Fixed& operator-=(Fixed other) { return *this = *this - other; }
+    constexpr Fixed& operator*=(Fixed other) { return *this = *this * other; }
+    constexpr Fixed& operator/=(Fixed other) { return *this = *this / other; }
+
+    constexpr auto operator<=>(const Fixed&) const = default;
+
+private:
+    static constexpr i32 saturate(i64 value) {
+        if (value > INT32_MAX) return INT32_MAX;
+        if (value < INT32_MIN) return INT32_MIN;
+        return static_cast<i32>(value);
+    }
+
+    static constexpr i32 from_float(float value) {
+        float scaled = value * ONE;
+        if (scaled >= 2147483647.f) return INT32_MAX;
+        if (scaled <= -2147483648.f) return INT32_MIN;
+        return static_cast<i32>(scaled < 0 ? scaled - 0.5f : scaled + 0.5f);
+    }
+};
+
+using Q16_16 = Fixed<16>;
+
+// Numeric policy of the filters and controllers, the operations that float
+// and Fixed don't share a spelling for
+template<typename T>
+struct Numeric;
+
+template<>
+struct Numeric<float> {
+    static constexpr float from_ratio(i64 num, i64 den) {
+        return static_cast<float>(num) / static_cast<float>(den);
+    }
+    static constexpr float abs(float value) {
+        return value < 0 ? -value : value;
+    }
+};
+
+template<int FRAC_BITS>
+struct Numeric<Fixed<FRAC_BITS>> {
+    using T = Fixed<FRAC_BITS>;
+
+    static constexpr T from_ratio(i64 num, i64 den) {
+        return T::from_ratio(num, den);
+    }
+    static constexpr T abs(T value) {
+        return value.raw < 0 ? -value : value;
+    }
+};
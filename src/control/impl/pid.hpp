@@ -1,54 +1,96 @@
 #pragma once
 #include <algorithm>
 #include <pico/time.h>
+#include "numeric.hpp"
 
+template<typename T = float>
 class PID {
-    float kP, kI, kD;
-    float last_value = 0;
-    float accumulator = 0;
+    // The derivative is low pass filtered with a time constant of Td / N
+    static constexpr i32 DERIVATIVE_FILTER_N = 8;
 
-    float outMin = 0, outMax = 0;
+    T kP, kI, kD;
+    T derivative_time_constant = 0;
+    T tracking_gain = 1;
+    T last_value = 0;
+    T derivative = 0;
+    T accumulator = 0;
 
-    float target_value = 0;
+    T outMin = 0, outMax = 0;
+
+    T target_value = 0;
     absolute_time_t last_update_time {0};
 
 public:
-    constexpr explicit PID(float kP, float kI, float kD, float outMin, float outMax)
-        : kP(kP), kI(kI), kD(kD), outMin(outMin), outMax(outMax) {}
+    constexpr explicit PID(T kP, T kI, T kD, T outMin, T outMax)
+        : kP(kP), kI(kI), kD(kD), outMin(outMin), outMax(outMax) {
+        update_derived_params();
+    }
 
-    constexpr void set_target(float target) {
+    constexpr void set_target(T target) {
         target_value = target;
     }
-    constexpr float get_target() const {
+    constexpr T get_target() const {
         return target_value;
     }
 
-    float update(float curr_value) {
+    // Limits can change between updates, the anti-windup follows them
+    constexpr void set_output_limits(T min, T max) {
+        outMin = min;
+        outMax = max;
+    }
+
+    T update(T curr_value) {
         absolute_time_t curr_time = get_absolute_time();
-        float delta_time = absolute_time_diff_us(last_update_time, curr_time) / 1'000'000.0;
+        T delta_time = Numeric<T>::from_ratio(absolute_time_diff_us(last_update_time, curr_time), 1'000'000);
         last_update_time = curr_time;
+        return update(curr_value, delta_time);
+    }
 
-        float error = target_value - curr_value;
+    // For callers that time the updates themselves, `delta_time` is in seconds
+    T update(T curr_value, T delta_time) {
+        T error = target_value - curr_value;
 
-        float change_rate = -(curr_value - last_value) / delta_time;
+        T change_rate = -(curr_value - last_value) / delta_time;
         last_value = curr_value;
+        derivative += (change_rate - derivative) * (delta_time / (derivative_time_constant + delta_time));
 
-        accumulator += kI * error * delta_time;
+        T unsaturated = error * kP + derivative * kD + accumulator;
+        T output = std::clamp(unsaturated, outMin, outMax);
 
-        accumulator = std::clamp(accumulator, outMin, outMax);
+        // Back-calculation anti-windup, the integrator is pulled back by
+        // how far the output is saturated
+        accumulator += (kI * error + (output - unsaturated) * tracking_gain) * delta_time;
 
-        return std::clamp(error * kP + change_rate * kD + accumulator, outMin, outMax);
+        return output;
     }
 
-    void reset(float curr_value) {
+    void reset(T curr_value) {
         last_value = curr_value;
         last_update_time = get_absolute_time();
+        derivative = 0;
         accumulator = 0;
     }
 
-    void set_params(float kp, float ki, float kd) {
+    void set_params(T kp, T ki, T kd) {
         this->kP = kp;
         this->kI = ki;
         this->kD = kd;
+        update_derived_params();
+    }
+
+private:
+    // Tracking time of the anti-windup is the derivative time Td = kD / kP,
+    // the low end of the usual Td to Ti range. Tracking at Ti would let the
+    // derivative braking during warm-up wind the integrator up to the limit.
+    constexpr void update_derived_params() {
+        T zero = 0;
+        derivative_time_constant = kP > zero ? kD / (kP * T(DERIVATIVE_FILTER_N)) : zero;
+        if (kP > zero && kD > zero) {
+            tracking_gain = kP / kD;
+        } else if (kP > zero && kI > zero) {
+            tracking_gain = kI / kP;
+        } else {
+            tracking_gain = 1;
+        }
     }
 };
@@ -0,0 +1,60 @@
+#pragma once
+#include <hardware/structs/systick.h>
+#include "inttypes.hpp"
+
+// Cycle counting based on the SysTick timer of the current core. It counts
+// down at clk_sys and wraps every 2^24 cycles, so spans longer than that
+// (~134 ms at 125 MHz) alias.
+namespace profiler {
+constexpr u32 COUNTER_MASK = 0x00FF'FFFF;
+
+inline void init() {
+    systick_hw->rvr = COUNTER_MASK;
+    systick_hw->cvr = 0;
+    systick_hw->csr = 0b101; // Enable, clocked from clk_sys, no interrupt
+}
+
+inline u32 cycles() {
+    return systick_hw->cvr;
+}
+
+inline u32 cycles_since(u32 start) {
+    return (start - systick_hw->cvr) & COUNTER_MASK;
+}
+}
+
+// Histogram with power of two buckets. Bucket 0 counts zero cycle samples,
+// bucket i counts samples in [2^(i-1), 2^i).
+struct Histogram {
+    static constexpr usize BUCKETS = 25;
+
+    u32 counts[BUCKETS] = {0};
+    u32 total = 0;
+    u32 max = 0;
+
+    void add(u32 value) {
+        usize bucket = value == 0 ? 0 : 32 - __builtin_clz(value);
+        if (bucket >= BUCKETS) bucket = BUCKETS - 1;
+        counts[bucket]++;
+        total++;
+        if (value > max) max = value;
+    }
+
+    // Returns the upper bound of the bucket containing the given percentile
+    u32 percentile(u32 permille) const {
+        u32 needed = (static_cast<u64>(total) * permille + 999) / 1000;
+        u32 seen = 0;
+        for (usize i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= needed && seen > 0) {
+                u32 upper = i == 0 ? 0 : (1u << i) - 1;
+                return upper < max ? upper : max;
+            }
+        }
+        return max;
+    }
+
+    void reset() {
+        *this = Histogram();
+    }
+};
@@ -0,0 +1,57 @@
+#pragma once
+#include <array>
+#include "inttypes.hpp"
+
+// Recursive least squares estimate of the parameters of y = theta . x.
+// Starts from a prior with a diagonal covariance, every sample is weighted
+// by its measurement variance, there is no forgetting.
+template<usize N>
+class RecursiveLeastSquares {
+    using Vector = std::array<float, N>;
+
+    Vector theta {};
+    std::array<Vector, N> covariance {};
+    u32 samples = 0;
+
+public:
+    void reset(const Vector& initial, const Vector& variance) {
+        theta = initial;
+        covariance = {};
+        for (usize i = 0; i < N; i++) {
+            covariance[i][i] = variance[i];
+        }
+        samples = 0;
+    }
+
+    void update(const Vector& x, float y, float measurement_variance) {
+        Vector px {};
+        for (usize i = 0; i < N; i++) {
+            for (usize j = 0; j < N; j++) {
+                px[i] += covariance[i][j] * x[j];
+            }
+        }
+        float innovation_variance = measurement_variance;
+        float prediction = 0;
+        for (usize i = 0; i < N; i++) {
+            innovation_variance += x[i] * px[i];
+            prediction += theta[i] * x[i];
+        }
+
+        float error = y - prediction;
+        for (usize i = 0; i < N; i++) {
+            float gain = px[i] / innovation_variance;
+            theta[i] += gain * error;
+            for (usize j = 0; j < N; j++) {
+                covariance[i][j] -= gain * px[j];
+            }
+        }
+        samples++;
+    }
+
+    const Vector& estimate() const {
+        return theta;
+    }
+    u32 sample_count() const {
+        return samples;
+    }
+};
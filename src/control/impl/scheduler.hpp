@@ -0,0 +1,103 @@
+#pragma once
+#include <hardware/sync.h>
+#include <hardware/timer.h>
+#include <pico/time.h>
+#include "inttypes.hpp"
+#include "profiler.hpp"
+
+struct TaskStats {
+    u32 runs = 0;
+    u32 deadline_misses = 0;
+    u32 last_jitter_us = 0;
+    u32 max_jitter_us = 0;
+    u32 max_run_time_us = 0;
+};
+
+// A periodic task released by a repeating hardware alarm. The alarm only
+// marks the task as pending, the task itself runs from the main loop.
+struct Task {
+    void(*func)();
+    u32 period_us;
+
+    repeating_timer_t timer {};
+    volatile bool pending = false;
+    volatile u64 release_time = 0;
+    volatile u32 overruns = 0; // Released again before it got to run
+    TaskStats stats;
+    Histogram run_cycles;
+
+    Task(void(*func)(), u32 rate_hz)
+        : func(func), period_us(1'000'000 / rate_hz) {}
+
+    static bool on_release(repeating_timer_t* timer) {
+        Task& task = *static_cast<Task*>(timer->user_data);
+        if (task.pending) {
+            task.overruns = task.overruns + 1;
+        }
+        task.release_time = time_us_64();
+        task.pending = true;
+        return true;
+    }
+
+    void run() {
+        u32 save = save_and_disable_interrupts();
+        bool is_pending = pending;
+        u64 released = release_time;
+        pending = false;
+        restore_interrupts(save);
+
+        if (!is_pending) return;
+
+        u64 start = time_us_64();
+        u32 start_cycles = profiler::cycles();
+        func();
+        run_cycles.add(profiler::cycles_since(start_cycles));
+        u64 end = time_us_64();
+
+        u32 jitter = start - released;
+        u32 run_time = end - start;
+        stats.runs++;
+        stats.last_jitter_us = jitter;
+        if (jitter > stats.max_jitter_us) stats.max_jitter_us = jitter;
+        if (run_time > stats.max_run_time_us) stats.max_run_time_us = run_time;
+        if (end - released > period_us) stats.deadline_misses++;
+    }
+};
+
+template <usize N>
+struct Scheduler {
+    Task tasks[N];
+
+    // Must be called from the core the tasks should run on, since the
+    // alarms fire on the core that registered them.
+    void start() {
+        for (Task& task : tasks) {
+            task.pending = true;
+            task.release_time = time_us_64();
+            // Negative delay keeps a fixed period between releases
+            add_repeating_timer_us(-static_cast<i64>(task.period_us),
+                                   Task::on_release, &task, &task.timer);
+        }
+    }
+
+    // For the states that don't run the tasks. A task left released but
+    // never run would count every further release as a missed deadline.
+    void stop() {
+        for (Task& task : tasks) {
+            cancel_repeating_timer(&task.timer);
+            task.pending = false;
+        }
+    }
+
+    void run_pending() {
+        for (Task& task : tasks) {
+            task.run();
+        }
+    }
+
+    TaskStats stats(usize i) const {
+        TaskStats s = tasks[i].stats;
+        s.deadline_misses += tasks[i].overruns;
+        return s;
+    }
+};
@@ -0,0 +1,31 @@
+#pragma once
+#include <hardware/sync.h>
+#include "inttypes.hpp"
+
+// Sequence lock for handing a value from a single writer to readers on the
+// other core. The writer never waits, readers retry when they raced a write.
+template <typename T>
+class SeqLock {
+    volatile u32 sequence = 0;
+    T value {};
+
+public:
+    void write(const T& new_value) {
+        sequence = sequence + 1; // Odd while the write is in progress
+        __dmb();
+        value = new_value;
+        __dmb();
+        sequence = sequence + 1;
+    }
+
+    T read() const {
+        while (true) {
+            u32 start = sequence;
+            if (start & 1) continue;
+            __dmb();
+            T copy = value;
+            __dmb();
+            if (sequence == start) return copy;
+        }
+    }
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <concepts>
 #include <tuple>
 #include "coroutine.hpp"
@@ -8,8 +10,6 @@
 namespace statemachine {
 
 volatile inline int curr_state_id = -1;
-inline void(*curr_state_exit)() = nullptr;
-inline bool(*curr_state_check_transitions)() = nullptr;
 
 template <typename T>
 concept StateC = requires {
@@ -20,34 +20,57 @@ concept StateC = requires {
     { T::coroutine() } -> std::same_as<Coroutine>;
 };
 
+// Entry of the dispatch table, one per state
+struct StateOps {
+    int id = -1;
+    void(*on_enter)() = nullptr;
+    void(*on_exit)() = nullptr;
+    bool(*check_transitions)() = nullptr;
+    Coroutine(*coroutine)() = nullptr;
+};
+
+template <StateC T>
+inline constexpr StateOps state_ops {T::ID, T::on_enter, T::on_exit, T::check_transitions, T::coroutine};
+
+inline const StateOps* curr_state = nullptr;
+
+inline void enter_state(const StateOps& state) {
+    curr_state_id = state.id;
+    curr_state = &state;
+    state.on_enter();
+    state.coroutine();
+}
+
 template <StateC T>
 void enter_state() {
-    curr_state_id = T::ID;
-    curr_state_exit = T::on_exit;
-    curr_state_check_transitions = T::check_transitions;
-    T::on_enter();
-    T::coroutine();
+    enter_state(state_ops<T>);
 }
 
 inline void leave_state() {
-    if (curr_state_exit) {
-        curr_state_exit();
-        curr_state_exit = nullptr;
+    if (curr_state) {
+        curr_state->on_exit();
+        curr_state = nullptr;
     }
 
-    if (Coroutine::has_coroutine) {
-        Coroutine::handle().destroy();
-    }
+    Coroutine::destroy_all();
     curr_state_id = -1;
 }
 
-template <StateC T>
-void change_state() {
-    if (curr_state_id == T::ID) return;
+inline bool check_transitions() {
+    return curr_state && curr_state->check_transitions();
+}
+
+inline void change_state(const StateOps& state, protocol::TransitionCause cause) {
+    if (curr_state_id == state.id) return;
     int old_state = curr_state_id;
     leave_state();
-    enter_state<T>();
-    protocol::on_state_change(old_state, curr_state_id);
+    enter_state(state);
+    protocol::on_state_change(old_state, curr_state_id, cause);
+}
+
+template <StateC T>
+void change_state(protocol::TransitionCause cause) {
+    change_state(state_ops<T>, cause);
 }
 
 template <int id>
@@ -59,27 +82,32 @@ struct State {
     static Coroutine coroutine() {co_return;};
 };
 
+// Dispatch table of all states indexed by their ID, IDs without a state
+// are left empty
 template <typename States>
-struct change_state_by_id_impl;
-
-template <StateC T, StateC... Rest>
-struct change_state_by_id_impl<std::tuple<T, Rest...>> {
-    static void exec(int id) {
-        if (T::ID == id) {
-            change_state<T>();
-        } else {
-            change_state_by_id_impl<std::tuple<Rest...>>::exec(id);
-        }
-    }
-};
+struct StateTable;
+
+template <StateC... S>
+struct StateTable<std::tuple<S...>> {
+    static constexpr usize SIZE = std::max({S::ID...}) + 1;
+    static_assert(((S::ID >= 0) && ...), "State IDs can't be negative");
 
-template <>
-struct change_state_by_id_impl<std::tuple<>> {
-    static void exec(int id) { (void)id; }
+    static constexpr std::array<StateOps, SIZE> ops = [] {
+        std::array<StateOps, SIZE> table {};
+        ((table[S::ID] = state_ops<S>), ...);
+        return table;
+    }();
+    static_assert([] {
+        usize filled = 0;
+        for (const StateOps& state : ops) filled += state.id >= 0;
+        return filled == sizeof...(S);
+    }(), "State IDs must be unique");
 };
 
 template <typename States>
-void change_state_by_id(int id) {
-    change_state_by_id_impl<States>::exec(id);
+void change_state_by_id(int id, protocol::TransitionCause cause) {
+    using Table = StateTable<States>;
+    if (id < 0 || static_cast<usize>(id) >= Table::SIZE || Table::ops[id].id < 0) return;
+    change_state(Table::ops[id], cause);
 }
 };
@@ -0,0 +1,78 @@
+#pragma once
+#include <algorithm>
+#include "brew_profile.hpp"
+#include "control/control.hpp"
+
+// Runs a brew profile at the control rate. An update interpolates the
+// target of the current phase and checks its exit, moving on by at most
+// one phase, so its cost doesn't depend on the profile.
+class ProfileRunner {
+    static constexpr float NO_FLOW_LIMIT = 99999;
+
+    const BrewProfile* profile = nullptr;
+    u32 phase = 0;
+    float phase_start = 0; // s since the shot started
+
+    static bool has_ended(const ProfilePhase& phase, const control::Sensors& sensors, float phase_time,
+                          float volume, bool weight_ready, float drip) {
+        if (phase.max_time > 0 && phase_time >= phase.max_time * ProfilePhase::TIME_UNIT) return true;
+        float exit_value = phase.exit_value * phase.exit_unit();
+        switch (phase.exit) {
+        case PhaseExit::Time: return phase_time >= exit_value;
+        case PhaseExit::Weight: return weight_ready && sensors.weight + drip >= exit_value;
+        case PhaseExit::Volume: return volume >= exit_value;
+        case PhaseExit::PressureAbove: return sensors.pressure >= exit_value;
+        case PhaseExit::PressureBelow: return sensors.pressure <= exit_value;
+        default: return false;
+        }
+    }
+
+public:
+    struct Targets {
+        float pressure;
+        float flow;
+    };
+
+    void start(const BrewProfile& new_profile) {
+        profile = &new_profile;
+        phase = 0;
+        phase_start = 0;
+    }
+
+    u32 current_phase() const {
+        return phase;
+    }
+
+    // Target of the weight exit ending the last phase, 0 without one
+    float final_weight() const {
+        if (profile->phase_count == 0) return 0;
+        const ProfilePhase& last = profile->phases[profile->phase_count - 1];
+        return last.exit == PhaseExit::Weight ? last.exit_value * ProfilePhase::WEIGHT_UNIT : 0;
+    }
+
+    // `time` and the pumped `volume` count from the start of the shot,
+    // weight exits wait until the scale is tared. The weight exit of the last
+    // phase stops the pump, so it fires `drip` grams early. False once the
+    // last phase has ended.
+    bool update(const control::Sensors& sensors, float time, float volume, bool weight_ready, float drip,
+                Targets& targets) {
+        if (phase >= profile->phase_count) return false;
+        float phase_drip = phase + 1 == profile->phase_count ? drip : 0;
+        if (has_ended(profile->phases[phase], sensors, time - phase_start, volume, weight_ready, phase_drip)) {
+            phase_start = time;
+            if (++phase >= profile->phase_count) return false;
+        }
+
+        const ProfilePhase& p = profile->phases[phase];
+        float ramp = p.ramp_time > 0 ? std::min((time - phase_start) / (p.ramp_time * ProfilePhase::TIME_UNIT), 1.f) : 1;
+        float target = (p.start + (static_cast<float>(p.end) - p.start) * ramp) * p.target_unit();
+        if (p.target == PhaseTarget::Pressure) {
+            targets.pressure = target;
+            targets.flow = p.limit > 0 ? p.limit * ProfilePhase::FLOW_UNIT : NO_FLOW_LIMIT;
+        } else {
+            targets.pressure = p.limit > 0 ? p.limit * ProfilePhase::PRESSURE_UNIT : ProfilePhase::MAX_PRESSURE;
+            targets.flow = target;
+        }
+        return true;
+    }
+};
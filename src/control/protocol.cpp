@@ -7,7 +7,10 @@
 #include <pico/mutex.h>
 #include <hardware/watchdog.h>
 #include <pico/types.h>
+#include "control/brew_log.hpp"
 #include "control/control.hpp"
+#include "control/impl/coroutine.hpp"
+#include "control/impl/seqlock.hpp"
 #include "control/impl/state_machine.hpp"
 #include "control/states.hpp"
 #include "ff.h"
@@ -16,6 +19,9 @@
 #include "network/messages.hpp"
 #include "network/ntp.hpp"
 #include "hardware/sd_card.hpp"
+#include "brew_profile.hpp"
+#include "calibration.hpp"
+#include "settings.hpp"
 
 using namespace protocol;
 
@@ -25,31 +31,63 @@ auto_init_mutex(core1_alive_mutex);
 static volatile bool core1_alive = false;
 static volatile bool core1_watchdog_enabled = false;
 
-auto_init_mutex(next_state_mutex);
-static volatile int next_state = -1;
+// Only touched by core 0, network messages are handled by the main loop
+static int next_state = -1;
+static TransitionCause next_state_cause;
+
+static TransitionHistory history;
+static SeqLock<TransitionHistory> published_history;
+static SeqLock<TaskStatsSnapshot> published_task_stats;
 
-struct BrewLog {
-    float time;
-    control::Sensors sensors;
-    bool steam_switch_pressed;
-};
 static FIL brew_log_file;
 char brew_log_filename[32];
-constexpr i32 BREW_LOG_VERSION = 4;
+
+static Histogram loop_stage_profiles[static_cast<usize>(LoopStage::Count)];
+
+// Records the cycles spent since `start` and returns the start of the next stage
+static u32 profile_stage(LoopStage stage, u32 start) {
+    loop_stage_profiles[static_cast<usize>(stage)].add(profiler::cycles_since(start));
+    return profiler::cycles();
+}
+
+static Scheduler<TASK_COUNT> scheduler {{
+    Task(control::update_pressure, control::PRESSURE_RATE_HZ),
+    Task(control::update_temperature, control::TEMP_RATE_HZ),
+    Task(control::update_flow, control::FLOW_RATE_HZ),
+    // Coroutines are resumed at the pressure rate, so `next_cycle` always
+    // sees a fresh pressure sample
+    Task(Coroutine::resume_all, control::PRESSURE_RATE_HZ),
+    Task(control::update_heater, control::HEATER_RATE_HZ),
+    Task(control::update_pump, control::PUMP_RATE_HZ),
+    Task(control::update_lights, control::LIGHTS_RATE_HZ),
+}};
 
 int protocol::get_state_id() {
     return statemachine::curr_state_id;
 }
 
-void protocol::schedule_state_change_by_id(int id) {
-    mutex_enter_blocking(&next_state_mutex);
+void protocol::schedule_state_change_by_id(int id, TransitionCause cause) {
     next_state = id;
-    mutex_exit(&next_state_mutex);
+    next_state_cause = cause;
 }
 
-void protocol::on_state_change(int old_state_id, int new_state_id) {
-    (void)old_state_id;
-    _state.state_change_time = get_absolute_time();
+void protocol::on_state_change(int old_state_id, int new_state_id, TransitionCause cause) {
+    absolute_time_t now = get_absolute_time();
+    history.entries[history.count % TRANSITION_HISTORY_SIZE] = {
+        .time = now,
+        .time_in_state_ms = static_cast<u32>(absolute_time_diff_us(_state.state_change_time, now) / 1000),
+        .old_state = old_state_id,
+        .new_state = new_state_id,
+        .cause = cause,
+    };
+    history.count++;
+    published_history.write(history);
+
+    _state.state_change_time = now;
+
+    // Off never gets to run the tasks
+    if (new_state_id == OffState::ID) scheduler.stop();
+    if (old_state_id == OffState::ID) scheduler.start();
 
     StateChangeMessage msg;
     msg.new_state = new_state_id;
@@ -60,15 +98,17 @@ void protocol::on_state_change(int old_state_id, int new_state_id) {
 
 void protocol::set_power(bool on) {
     if (statemachine::curr_state_id == OffState::ID && on) {
-        schedule_state_change<StandbyState>();
+        schedule_state_change<StandbyState>(TransitionCause::Network);
     } else if (statemachine::curr_state_id != OffState::ID && !on){
-        schedule_state_change<OffState>();
+        schedule_state_change<OffState>(TransitionCause::Network);
     }
 }
 
 void protocol::main_loop() {
+    // The scheduler starts once the machine leaves Off
     statemachine::enter_state<OffState>();
     state().last_loop_time = get_absolute_time();
+    profiler::init();
 
     while (true) {
         absolute_time_t now = get_absolute_time();
@@ -78,7 +118,9 @@ void protocol::main_loop() {
         }
         state().last_loop_time = now;
 
+        u32 stage_start = profiler::cycles();
         hardware::check_thermals();
+        stage_start = profile_stage(LoopStage::Thermals, stage_start);
 
         // Only update watchdog if core1 is also alive
         if (mutex_try_enter(&core1_alive_mutex, nullptr)) {
@@ -89,39 +131,35 @@ void protocol::main_loop() {
             mutex_exit(&core1_alive_mutex);
         }
 
-        // Process scheduled state change
-        if (mutex_try_enter(&next_state_mutex, nullptr)) {
-            if (next_state >= 0) {
-                statemachine::change_state_by_id<States>(next_state);
-                next_state = -1;
-                mutex_exit(&next_state_mutex);
-                continue;
-            } else {
-                mutex_exit(&next_state_mutex);
-            }
-        }
+        stage_start = profiler::cycles();
 
-        bool should_restart = statemachine::curr_state_check_transitions();
-        if (should_restart) continue;
+        // Handle network messages and the state change they might've scheduled
+        network::process_incoming_messages();
+        hardware::flash_pause_point();
+        if (hardware::get_switch_changes()) {
+            Coroutine::wake(Coroutine::SWITCH_CHANGE);
+        }
 
-        if (hardware::is_power_just_pressed()) {
-            statemachine::change_state<OffState>();
+        if (next_state >= 0) {
+            int id = next_state;
+            next_state = -1;
+            statemachine::change_state_by_id<States>(id, next_state_cause);
+            profile_stage(LoopStage::Mailbox, stage_start);
             continue;
         }
+        stage_start = profile_stage(LoopStage::Mailbox, stage_start);
 
-        control::update_sensors();
+        bool should_restart = statemachine::check_transitions();
+        profile_stage(LoopStage::Transitions, stage_start);
+        if (should_restart) continue;
 
-        if (Coroutine::has_coroutine) {
-            Coroutine::Handle handle = Coroutine::handle();
-            if (!Coroutine::curr_awaiter || Coroutine::curr_awaiter->should_resume()) {
-                handle.resume();
-                if (handle.done()) {
-                    handle.destroy();
-                }
-            }
+        if (hardware::is_power_just_pressed()) {
+            statemachine::change_state<OffState>(TransitionCause::Switch);
+            continue;
         }
 
-        control::update();
+        scheduler.run_pending();
+        control::publish_sensors();
     }
 }
 
@@ -175,6 +213,7 @@ void protocol::network_loop() {
     SensorStatusMessage msg;
     absolute_time_t sensor_message_time = nil_time;
     absolute_time_t sensor_log_time = nil_time;
+    absolute_time_t heater_message_time = nil_time;
 
     // Enable watchdog
     mutex_enter_blocking(&core1_alive_mutex);
@@ -198,12 +237,19 @@ void protocol::network_loop() {
         }
 
         network::process_outgoing_messages();
+        // Flash writes pause core 0, so changes made during a shot are only
+        // saved once it is over
+        if (get_state_id() != BrewState::ID) {
+            settings::flush();
+            brew_profile::flush();
+            calibration::flush();
+        }
 
         if (get_state_id() != OffState::ID && time_reached(sensor_message_time)) {
             sensor_message_time = make_timeout_time_ms(get_state_id() == BrewState::ID ? 100 : 250);
 
             if (network::message_queue_size() < 5) {
-                const control::Sensors& s = control::sensors();
+                const control::Sensors s = control::sensors_snapshot().sensors;
                 msg.pressure = s.pressure;
                 msg.temp = s.temperature;
                 msg.weight = hardware::is_scale_connected() ? s.weight : NAN;
@@ -212,12 +258,32 @@ void protocol::network_loop() {
             }
         }
 
+        if (get_state_id() != OffState::ID && time_reached(heater_message_time)) {
+            heater_message_time = make_timeout_time_ms(1000);
+
+            if (network::message_queue_size() < 5) {
+                control::SensorSnapshot snapshot = control::sensors_snapshot();
+                const control::HeaterMetrics& metrics = snapshot.heater_metrics;
+                network::enqueue_message(HeaterStatusMessage {
+                    .gains = static_cast<u32>(metrics.gains),
+                    .target = metrics.target,
+                    .overshoot = metrics.overshoot,
+                    .settling_time = metrics.settling_time,
+                    .power = snapshot.heater.power,
+                    .feedforward = snapshot.heater.feedforward,
+                    .temp_faults = hardware::get_temp_faults(),
+                });
+            }
+        }
+
         if (get_state_id() == BrewState::ID && time_reached(sensor_log_time)) {
             sensor_log_time = make_timeout_time_ms(100);
 
+            control::SensorSnapshot snapshot = control::sensors_snapshot();
             BrewLog brew_log {
-                .time = absolute_time_diff_us(_state.brew_start_time, get_absolute_time()) / 1'000'000.0f,
-                .sensors = control::sensors(),
+                .time = absolute_time_diff_us(_state.brew_start_time, snapshot.time) / 1'000'000.0f,
+                .sensors = snapshot.sensors,
+                .heater = snapshot.heater,
                 .steam_switch_pressed = hardware::get_switch(hardware::Steam),
             };
             UINT written;
@@ -233,3 +299,31 @@ void protocol::network_loop() {
 MachineState& protocol::state() {
     return _state;
 }
+
+TaskStats protocol::task_stats(usize task) {
+    return scheduler.stats(task);
+}
+
+void protocol::publish_task_stats() {
+    TaskStatsSnapshot snapshot;
+    for (usize i = 0; i < TASK_COUNT; i++) {
+        snapshot.tasks[i] = scheduler.stats(i);
+    }
+    published_task_stats.write(snapshot);
+}
+
+TaskStatsSnapshot protocol::task_stats_snapshot() {
+    return published_task_stats.read();
+}
+
+TransitionHistory protocol::transition_history() {
+    return published_history.read();
+}
+
+const Histogram& protocol::stage_profile(usize stage) {
+    constexpr usize loop_stages = static_cast<usize>(LoopStage::Count);
+    if (stage < loop_stages) {
+        return loop_stage_profiles[stage];
+    }
+    return scheduler.tasks[stage - loop_stages].run_cycles;
+}
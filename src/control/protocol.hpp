@@ -1,7 +1,47 @@
 #pragma once
 #include <pico/time.h>
+#include "control/impl/profiler.hpp"
+#include "control/impl/scheduler.hpp"
 
 namespace protocol {
+constexpr usize TASK_COUNT = 7;
+
+// Main loop stages outside of the scheduler, the profile of each scheduler
+// task follows after these
+enum class LoopStage : u32 {
+    Thermals,
+    Mailbox,
+    Transitions,
+    Count,
+};
+constexpr usize PROFILE_STAGE_COUNT = static_cast<usize>(LoopStage::Count) + TASK_COUNT;
+
+struct TaskStatsSnapshot {
+    TaskStats tasks[TASK_COUNT];
+};
+
+// What asked for a state change
+enum class TransitionCause : u32 {
+    Switch, // A state's check_transitions or the power button
+    Network,
+    Coroutine, // A state finished or gave up by itself
+};
+
+struct Transition {
+    absolute_time_t time;
+    u32 time_in_state_ms; // Spent in the state that was left
+    i32 old_state;
+    i32 new_state;
+    TransitionCause cause;
+};
+
+// The last transitions, kept in RAM to diagnose unexpected state changes
+constexpr usize TRANSITION_HISTORY_SIZE = 8;
+struct TransitionHistory {
+    Transition entries[TRANSITION_HISTORY_SIZE];
+    u32 count; // Since boot, the newest is entries[(count - 1) % TRANSITION_HISTORY_SIZE]
+};
+
 struct MachineState {
     absolute_time_t machine_start_time;
     absolute_time_t state_change_time;
@@ -14,13 +54,21 @@ void init();
 void main_loop();
 void set_power(bool on);
 void network_loop();
-void on_state_change(int old_state_id, int new_state_id);
+void on_state_change(int old_state_id, int new_state_id, TransitionCause cause);
 int get_state_id();
-void schedule_state_change_by_id(int id);
+void schedule_state_change_by_id(int id, TransitionCause cause);
 MachineState& state();
+TaskStats task_stats(usize task);
+// Copies the task stats for task_stats_snapshot, core 0 keeps updating them
+void publish_task_stats();
+// The last published task stats, safe to call from core 1
+TaskStatsSnapshot task_stats_snapshot();
+const Histogram& stage_profile(usize stage);
+// Safe to call from core 1
+TransitionHistory transition_history();
 
 template <typename T>
-void schedule_state_change() {
-    schedule_state_change_by_id(T::ID);
+void schedule_state_change(TransitionCause cause) {
+    schedule_state_change_by_id(T::ID, cause);
 }
 }
@@ -1,8 +1,15 @@
 #pragma once
 #include "control/control.hpp"
+#include "control/impl/lut.hpp"
+#include "control/impl/pid.hpp"
+#include "control/impl/rls.hpp"
+#include "control/tuning.hpp"
+#include "calibration.hpp"
 #include "config.hpp"
 #include "settings.hpp"
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
 
 // Coeffitients for a polynomial, which maps a pressure to the max
 // flow of the pump per click. The polynomial was fitted based on values from
@@ -27,35 +34,145 @@ constexpr float get_flow_per_click_datasheet(float pressure) {
     }
     return result;
 }
-constexpr float get_flow_per_click(float pressure, float pump_zero) {
-    return get_flow_per_click_datasheet(pressure)
+// The polynomial interpolated from a table, the pump runs past 14 bar only
+// when the OPV is stuck, and the polynomial turns negative around 15 bar
+constexpr LookupTable<29> flow_per_click_table(get_flow_per_click_datasheet, 0, 14);
+constexpr float FLOW_PER_CLICK_TABLE_MAX_ERROR = 0.0003; // ml/click, 0.35 % at 9 bar
+static_assert(flow_per_click_table.max_error(get_flow_per_click_datasheet, 16) <= FLOW_PER_CLICK_TABLE_MAX_ERROR,
+              "Flow per click table is too coarse");
+
+// The datasheet curve is scaled and offset per pump, see FlowCalibration
+constexpr float get_flow_per_click(float pressure, float flow_gain, float pump_zero) {
+    return flow_per_click_table(pressure) * flow_gain
         + pump_zero;
 }
+// The zero is the pump_zero setting plus what the calibration learned on top
+inline float get_pump_zero() {
+    return settings::get().pump_zero + calibration::get().pump_zero_offset;
+}
+inline float get_flow_per_click(float pressure) {
+    return get_flow_per_click(pressure, calibration::get().pump_flow_gain, get_pump_zero());
+}
 inline float get_flow(float pressure, float click_count) {
-    return get_flow_per_click(pressure, settings::get().pump_zero) * click_count;
+    return get_flow_per_click(pressure) * click_count;
 }
 
-constexpr float get_power_for_pressure(float target_pressure, float current_pressure) {
-    float error = target_pressure - current_pressure;
-    if (error <= 0)
-        return 0;
-
-    constexpr auto FULL_AT = 3;
-    constexpr auto STEEPNESS = 0.4;
-    return powf(error / FULL_AT, STEEPNESS);
-}
 inline float get_power_for_flow(float target_flow, float current_pressure) {
     if (target_flow <= 0.0f) return 0;
-    float flow_per_click = get_flow_per_click(current_pressure, settings::get().pump_zero);
+    float flow_per_click = get_flow_per_click(current_pressure);
     float clicks_per_second = target_flow / flow_per_click;
     float power = clicks_per_second / MAINS_FREQUENCY_HZ;
     return power;
 }
 
-inline float calculate_desired_power(const control::Sensors& sensors,
-                                     float target_pressure,
-                                     float target_flow) {
-    float power_pressure = get_power_for_pressure(target_pressure, sensors.pressure);
-    float power_flow = get_power_for_flow(target_flow, sensors.pressure);
-    return fminf(fminf(power_pressure, power_flow), 1.f);
-}
+// Closed loop pump control on the filtered pressure. The setpoint ramps
+// towards the target instead of stepping, and the flow target caps the
+// output, the PID's anti-windup keeps track of that cap.
+class PressureController {
+    PID<tuning::Number> pid {tuning::PRESSURE_PID.kP, tuning::PRESSURE_PID.kI,
+                             tuning::PRESSURE_PID.kD, 0, 1};
+    float setpoint = 0;
+    absolute_time_t last_update_time = nil_time;
+
+public:
+    void reset(float pressure) {
+        setpoint = pressure;
+        pid.reset(pressure);
+        last_update_time = get_absolute_time();
+    }
+
+    // The ramp and the PID step by the same time since the last update
+    float update(const control::Sensors& sensors, float target_pressure, float target_flow) {
+        absolute_time_t now = get_absolute_time();
+        float dt = absolute_time_diff_us(last_update_time, now) / 1e6f;
+        last_update_time = now;
+
+        float max_step = tuning::PRESSURE_RAMP_BAR_PER_S * dt;
+        setpoint += std::clamp(target_pressure - setpoint, -max_step, max_step);
+        pid.set_target(setpoint);
+
+        float flow_limit = std::clamp(get_power_for_flow(target_flow, sensors.pressure), 0.f, 1.f);
+        pid.set_output_limits(0, flow_limit);
+        return static_cast<float>(pid.update(sensors.pressure, dt));
+    }
+};
+
+// Fits the gain and offset of the flow per click curve to the weight the
+// scale sees during a shot. Samples are taken over one second windows once
+// the cup is filling and the pressure is steady, so neither the puck nor
+// the pump's compliance soak up the water. Within a shot the clicks all run
+// at about the same pressure, so the offset gets a tight prior and the gain
+// takes most of the correction, shots at other pressures move the offset.
+class FlowCalibration {
+    static constexpr u32 WINDOW_UPDATES = control::FLOW_RATE_HZ;
+    static constexpr float MIN_WEIGHT = 5; // g, the cup is filling steadily
+    static constexpr float MAX_PRESSURE_CHANGE = 0.15; // bar over a window
+    static constexpr float GAIN_VARIANCE = 0.04;
+    static constexpr float ZERO_VARIANCE = 1e-5; // (ml/click)^2
+    static constexpr float WEIGHT_VARIANCE = 0.05; // g^2 per window
+    static constexpr u32 MIN_SAMPLES = 5;
+    static constexpr float MIN_GAIN = 0.5, MAX_GAIN = 1.5;
+
+    RecursiveLeastSquares<2> rls;
+    bool running = false;
+    bool window_open = false;
+    u32 window_updates = 0;
+    float window_datasheet_flow = 0;
+    float window_clicks = 0;
+    float window_start_weight = 0;
+    float window_start_pressure = 0;
+
+public:
+    bool is_running() const {
+        return running;
+    }
+
+    void start() {
+        rls.reset({calibration::get().pump_flow_gain, get_pump_zero()}, {GAIN_VARIANCE, ZERO_VARIANCE});
+        running = true;
+        window_open = false;
+    }
+
+    // Called after every flow update with the clicks since the last one
+    void update(const control::Sensors& sensors) {
+        if (!running) return;
+        if (sensors.weight < MIN_WEIGHT) {
+            window_open = false;
+            return;
+        }
+        if (window_open) {
+            window_datasheet_flow += flow_per_click_table(sensors.pressure) * sensors.pump_clicks;
+            window_clicks += sensors.pump_clicks;
+            if (++window_updates < WINDOW_UPDATES) return;
+
+            if (fabsf(sensors.pressure - window_start_pressure) <= MAX_PRESSURE_CHANGE) {
+                rls.update({window_datasheet_flow, window_clicks}, sensors.weight - window_start_weight,
+                           WEIGHT_VARIANCE);
+            }
+        }
+        // The clicks of the next update land on top of this weight
+        window_open = true;
+        window_updates = 0;
+        window_datasheet_flow = 0;
+        window_clicks = 0;
+        window_start_weight = sensors.weight;
+        window_start_pressure = sensors.pressure;
+    }
+
+    // Stores the fit in the calibration if the shot gave enough samples and
+    // the gain is plausible, the pump_zero setting stays as the user set it
+    void finish() {
+        if (!running) return;
+        running = false;
+
+        auto [gain, zero] = rls.estimate();
+        printf("Flow calibration: %u samples, gain %.3f, zero %.4f ml/click\n",
+               static_cast<unsigned>(rls.sample_count()), gain, zero);
+        if (rls.sample_count() < MIN_SAMPLES || gain < MIN_GAIN || gain > MAX_GAIN) return;
+
+        Calibration new_calibration = calibration::get();
+        new_calibration.pump_flow_gain = gain;
+        new_calibration.pump_zero_offset = zero - settings::get().pump_zero;
+        calibration::update(new_calibration);
+    }
+};
@@ -1,74 +1,86 @@
 #include "states.hpp"
 #include <cmath>
+#include <cstdio>
 #include <pico/time.h>
 #include "control.hpp"
+#include "events.hpp"
 #include "impl/coroutine.hpp"
 #include "network.hpp"
+#include "profile_runner.hpp"
 #include "protocol.hpp"
 #include "hardware/hardware.hpp"
+#include "brew_profile.hpp"
+#include "calibration.hpp"
 #include "settings.hpp"
 
+using protocol::TransitionCause;
+
 #define us_since(time) (absolute_time_diff_us((time), get_absolute_time()))
 #define ms_since(time) (absolute_time_diff_us((time), get_absolute_time()) / 1000)
 
 MaintenanceStatusMessage states::maintenance_msg;
+AutotuneStatusMessage states::autotune_msg;
 
 bool OffState::check_transitions() {
     if (hardware::is_power_just_pressed()) {
-        statemachine::change_state<StandbyState>();
+        statemachine::change_state<StandbyState>(TransitionCause::Switch);
     }
     return true;
 }
 
 bool StandbyState::check_transitions() {
     if (hardware::get_switch(hardware::Steam)) {
-        statemachine::change_state<SteamState>();
+        statemachine::change_state<SteamState>(TransitionCause::Switch);
         return true;
     }
     if (hardware::get_switch(hardware::Brew)) {
-        statemachine::change_state<BrewState>();
+        statemachine::change_state<BrewState>(TransitionCause::Switch);
         return true;
     }
     return false;
 }
 
-Coroutine StandbyState::coroutine() {
-    bool should_prefill =
-        us_since(protocol::state().machine_start_time) < 100'000 &&
-        protocol::state().cold_start;
-
-    if (should_prefill) {
-        hardware::set_pump(0.5);
-        hardware::set_solenoid(true);
+static bool prefilling = false;
 
-        co_await delay_ms(200);
+// Fills the boiler after a cold start, so it isn't heating a dry element
+Coroutine StandbyState::prefill() {
+    prefilling = true;
+    hardware::set_pump(0.5);
+    hardware::set_solenoid(true);
 
-        constexpr auto MAX_PREFILL_TIME_MS = 12000;
-        absolute_time_t timeout = make_timeout_time_ms(MAX_PREFILL_TIME_MS);
+    co_await delay_ms(200);
 
-        while (true) {
-            co_await delay_ms(10);
+    constexpr auto MAX_PREFILL_TIME_MS = 12000;
+    co_await with_timeout(pressure_above(0.42f), MAX_PREFILL_TIME_MS);
 
-            if (time_reached(timeout)) break;
+    hardware::set_pump(0);
+    hardware::set_solenoid(false);
+    co_await delay_ms(2000);
+    hardware::scale_start_tare();
+    prefilling = false;
+}
 
-            float pressure = control::sensors().pressure;
-            if (pressure > 0.42f) break;
-        }
+Coroutine StandbyState::coroutine() {
+    bool should_prefill =
+        us_since(protocol::state().machine_start_time) < 100'000 &&
+        protocol::state().cold_start;
 
-        hardware::set_pump(0);
-        hardware::set_solenoid(false);
-        co_await delay_ms(2000);
-        hardware::scale_start_tare();
+    prefilling = false;
+    if (should_prefill) {
+        prefill();
     }
 
+    // Lets the steam pressure out of the boiler, the prefill has the
+    // solenoid until it is done
     constexpr float PRESSURE_THRESHOLD = 0.7f;
     while (true) {
         co_await delay_ms(25'000);
+        co_await predicate([]{return !prefilling;});
         if (control::sensors().pressure > PRESSURE_THRESHOLD) {
             control::set_light_blink(250);
             co_await delay_ms(5'000);
             hardware::set_solenoid(true);
-            co_await predicate([]{return control::sensors().pressure < PRESSURE_THRESHOLD;});
+            co_await pressure_below(PRESSURE_THRESHOLD);
             control::set_light_blink(0);
         }
         hardware::set_solenoid(false);
@@ -77,7 +89,7 @@ Coroutine StandbyState::coroutine() {
 
 bool BrewState::check_transitions() {
     if (!hardware::get_switch(hardware::Brew)) {
-        statemachine::change_state<StandbyState>();
+        statemachine::change_state<StandbyState>(TransitionCause::Switch);
         return true;
     }
 
@@ -87,38 +99,49 @@ bool BrewState::check_transitions() {
     }
     return false;
 }
+// The profile's targets are set on every pass, the scale is tared just
+// before the end of the preinfusion
 Coroutine BrewState::coroutine() {
     bool has_scales = hardware::is_scale_connected();
     bool tare_started = false;
     bool tare_done = false;
-    bool preinfusion_done = false;
     absolute_time_t start = get_absolute_time();
 
     u32 preinfusion_ms = settings::get().preinfusion_time * 1000;
     u32 ms_before_tare = fmin(fmax(preinfusion_ms - 500, 0), 1000);
     float brew_weight = settings::get().brew_weight;
 
+    float start_volume = control::sensors().total_flow;
     float zero_flow = -1;
 
-    control::set_target_pressure(settings::get().preinfusion_pressure);
+    ProfileRunner runner;
+    runner.start(brew_profile::start_shot());
 
     while (true) {
-        if (ms_since(start) > preinfusion_ms && !preinfusion_done) {
-            preinfusion_done = true;
-            control::set_target_pressure(settings::get().brew_pressure);
-        }
-
         if (has_scales) {
             if (!tare_started && ms_since(start) > ms_before_tare) {
                 tare_started = true;
                 hardware::scale_start_tare();
             }
-            if (tare_started)
+            if (tare_started && !tare_done) {
                 tare_done = !hardware::is_scale_taring();
-            if (tare_done && brew_weight > 0 && control::sensors().weight >= brew_weight)
-                break;
+                if (tare_done) control::set_flow_calibration(true);
+            }
+        }
+
+        u32 phase = runner.current_phase();
+        ProfileRunner::Targets targets;
+        float volume = control::sensors().total_flow - start_volume;
+        if (!runner.update(control::sensors(), ms_since(start) / 1000.f, volume, tare_done,
+                           control::drip_estimate(), targets)) {
+            break;
         }
+        if (runner.current_phase() != phase) printf("Brew profile phase %u\n", static_cast<unsigned>(runner.current_phase()));
+        control::set_target_pressure(targets.pressure);
+        control::set_target_flow(targets.flow);
 
+        // The steam switch starts counting the pumped water towards the
+        // brew weight
         if (hardware::get_switch(hardware::Steam) && zero_flow < 0) {
             zero_flow = control::sensors().total_flow;
         }
@@ -132,24 +155,25 @@ Coroutine BrewState::coroutine() {
         co_await next_cycle;
     }
 
+    // The cup still fills after the pump stops
+    control::set_flow_calibration(false);
     hardware::set_solenoid(false);
     control::set_pump_enabled(false);
+    if (tare_done) control::set_weight_stopped(zero_flow < 0 ? runner.final_weight() : 0);
 
     control::set_light_blink(250);
 }
 
 bool SteamState::check_transitions() {
     if (!hardware::get_switch(hardware::Steam)) {
-        statemachine::change_state<StandbyState>();
+        statemachine::change_state<StandbyState>(TransitionCause::Switch);
         return true;
     }
     return false;
 }
 Coroutine SteamState::coroutine() {
     hardware::set_heater(1);
-    co_await predicate([] {
-        return control::sensors().temperature > settings::get().steam_temp;
-    });
+    co_await temperature_above(settings::get().steam_temp);
     hardware::set_light(hardware::Steam, true);
 
     const control::Sensors& sensors = control::sensors();
@@ -208,17 +232,7 @@ Coroutine BackflushState::coroutine() {
             control::set_target_pressure(settings::get().brew_pressure);
 
             co_await delay_ms(1000);
-
-            float last_pressure = control::sensors().pressure;
-
-            while (true) {
-                co_await delay_ms(100);
-
-                float pressure = control::sensors().pressure;
-                if (pressure - last_pressure < 0) break;
-                last_pressure = pressure;
-            }
-
+            co_await pressure_peak(100);
             co_await delay_ms(1000);
 
             control::set_pump_enabled(false);
@@ -233,13 +247,9 @@ Coroutine BackflushState::coroutine() {
         network::enqueue_message(states::maintenance_msg);
 
         control::set_light_blink(250);
-        if (j == 0) {
-            co_await predicate([]() {return hardware::get_switch(hardware::Steam);});
-        } else {
-            co_await predicate([]() {return !hardware::get_switch(hardware::Steam);});
-        }
+        co_await switch_is(hardware::Steam, j == 0);
     }
-    protocol::schedule_state_change<StandbyState>();
+    protocol::schedule_state_change<StandbyState>(TransitionCause::Coroutine);
 }
 
 Coroutine DescaleState::coroutine() {
@@ -277,9 +287,7 @@ Coroutine DescaleState::coroutine() {
         // Wait for tank refill
         control::set_light_blink(250);
         bool initial = hardware::get_switch(hardware::Brew);
-        while (hardware::get_switch(hardware::Brew) == initial) {
-            co_await next_cycle;
-        }
+        co_await switch_changed(hardware::Brew);
 
         // Rinsing
         states::maintenance_msg.stage = 2;
@@ -304,13 +312,108 @@ Coroutine DescaleState::coroutine() {
         hardware::set_solenoid(false);
     }
 
-    protocol::schedule_state_change<StandbyState>();
+    protocol::schedule_state_change<StandbyState>(TransitionCause::Coroutine);
 }
 
 Coroutine ManualControlState::coroutine() {
-    absolute_time_t timeout = make_timeout_time_ms(time_ms);
-    while (!time_reached(timeout)) {
-        co_await next_cycle;
+    co_await delay_ms(time_ms);
+    protocol::schedule_state_change<StandbyState>(TransitionCause::Coroutine);
+}
+
+// Classic Ziegler-Nichols gains from the ultimate gain and period, in the
+// simulator they reach brew temperature faster than the more conservative
+// rules without a larger temperature swing during the shot
+static void store_autotune_gains(float ultimate_gain, float ultimate_period) {
+    float kp = 0.6f * ultimate_gain;
+    float ti = 0.5f * ultimate_period;
+    float td = 0.125f * ultimate_period;
+
+    Calibration new_calibration = calibration::get();
+    new_calibration.heater_kp = kp;
+    new_calibration.heater_ki = kp / ti;
+    new_calibration.heater_kd = kp * td;
+    calibration::update(new_calibration, true);
+
+    states::autotune_msg.kp = new_calibration.heater_kp;
+    states::autotune_msg.ki = new_calibration.heater_ki;
+    states::autotune_msg.kd = new_calibration.heater_kd;
+}
+
+// Relay feedback: the heater is switched fully on below and off above the
+// brew temperature. The amplitude and period of the resulting oscillation
+// give the ultimate gain and period of the boiler.
+Coroutine AutotuneState::coroutine() {
+    constexpr float HYSTERESIS = 0.5f; // Keeps sensor noise from toggling the relay
+    constexpr float RELAY_AMPLITUDE = 0.5f; // Heater swings by 0.5 around 0.5
+    constexpr i32 SETTLING_CYCLES = 2;
+    constexpr i32 MEASURED_CYCLES = 3;
+    constexpr float MAX_OVERSHOOT = 15;
+    constexpr u32 TIMEOUT_MS = 40 * 60 * 1000;
+
+    AutotuneStatusMessage& msg = states::autotune_msg;
+    msg = {};
+    msg.stage = Heating;
+    network::enqueue_message(msg);
+
+    float setpoint = settings::get().brew_temp;
+    absolute_time_t timeout = make_timeout_time_ms(TIMEOUT_MS);
+    absolute_time_t cycle_start = nil_time;
+    bool heating = true;
+    float high = -INFINITY;
+    float low = INFINITY;
+    float amplitude_sum = 0;
+    float period_sum = 0;
+    hardware::set_heater(1);
+
+    while (msg.cycle < SETTLING_CYCLES + MEASURED_CYCLES) {
+        co_await delay_ms(250);
+
+        float temp = control::sensors().temperature;
+        if (time_reached(timeout) || temp > setpoint + MAX_OVERSHOOT) {
+            hardware::set_heater(0);
+            msg.stage = Failed;
+            network::enqueue_message(msg);
+            protocol::schedule_state_change<StandbyState>(TransitionCause::Coroutine);
+            co_return;
+        }
+        high = fmaxf(high, temp);
+        low = fminf(low, temp);
+
+        if (heating && temp > setpoint + HYSTERESIS) {
+            heating = false;
+            hardware::set_heater(0);
+        } else if (!heating && temp < setpoint - HYSTERESIS) {
+            heating = true;
+            hardware::set_heater(1);
+
+            // A cycle ends each time the heater switches back on
+            if (cycle_start != nil_time) {
+                msg.stage = Cycling;
+                msg.cycle++;
+                msg.amplitude = (high - low) / 2;
+                msg.period = us_since(cycle_start) / 1e6f;
+                if (msg.cycle > SETTLING_CYCLES) {
+                    amplitude_sum += msg.amplitude;
+                    period_sum += msg.period;
+                }
+                network::enqueue_message(msg);
+            }
+            cycle_start = get_absolute_time();
+            high = -INFINITY;
+            low = INFINITY;
+        }
     }
-    protocol::schedule_state_change<StandbyState>();
+    hardware::set_heater(0);
+
+    // Describing function of a relay with hysteresis
+    float amplitude = amplitude_sum / MEASURED_CYCLES;
+    float period = period_sum / MEASURED_CYCLES;
+    float ultimate_gain = 4 * RELAY_AMPLITUDE / (M_PI * sqrtf(fmaxf(amplitude * amplitude - HYSTERESIS * HYSTERESIS, 0.01f)));
+    store_autotune_gains(ultimate_gain, period);
+
+    msg.stage = Done;
+    msg.amplitude = amplitude;
+    msg.period = period;
+    network::enqueue_message(msg);
+    protocol::schedule_state_change<StandbyState>(TransitionCause::Coroutine);
 }
@@ -14,6 +14,7 @@ using State = statemachine::State<id>;
 
 namespace states {
 extern MaintenanceStatusMessage maintenance_msg;
+extern AutotuneStatusMessage autotune_msg;
 };
 
 struct OffState : State<0> {
@@ -29,7 +30,7 @@ struct OffState : State<0> {
     static void on_exit() {
         auto& state = protocol::state();
         state.machine_start_time = get_absolute_time();
-        state.cold_start = hardware::read_temp() < 70;
+        state.cold_start = hardware::read_temp().temperature < 70;
         hardware::set_light(hardware::Power, true);
         hardware::scale_start_tare();
         control::reset();
@@ -53,20 +54,25 @@ struct StandbyState : State<1> {
 
     static bool check_transitions();
     static Coroutine coroutine();
+    // Spawned by coroutine() after a cold start
+    static Coroutine prefill();
 };
 
 struct BrewState : State<2> {
     static void on_enter() {
         protocol::state().brew_start_time = get_absolute_time();
+        control::set_heater_gains(control::HeaterGains::Brew);
         hardware::set_solenoid(true);
         control::set_pump_enabled(true);
         control::set_target_flow(99999);
     }
 
     static void on_exit() {
+        control::set_flow_calibration(false);
         control::set_pump_enabled(false);
         hardware::set_solenoid(false);
         control::set_light_blink(0);
+        control::set_heater_gains(control::HeaterGains::Standby);
     }
 
     static bool check_transitions();
@@ -141,4 +147,28 @@ struct ManualControlState : State<6> {
     static Coroutine coroutine();
 };
 
-using States = std::tuple<OffState, StandbyState, BrewState, SteamState, BackflushState, DescaleState, ManualControlState>;
+// Finds the heater PID gains from a relay feedback experiment at brew
+// temperature and stores them in the settings
+struct AutotuneState : State<7> {
+    enum Stage : i32 {
+        Heating,
+        Cycling,
+        Done,
+        Failed,
+    };
+
+    static void on_enter() {
+        control::set_boiler_enabled(false);
+        control::set_pump_enabled(false);
+        hardware::set_solenoid(false);
+        control::set_light_blink(1000);
+    }
+
+    static void on_exit() {
+        hardware::set_heater(0);
+        control::set_light_blink(0);
+    }
+    static Coroutine coroutine();
+};
+
+using States = std::tuple<OffState, StandbyState, BrewState, SteamState, BackflushState, DescaleState, ManualControlState, AutotuneState>;
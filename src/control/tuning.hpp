@@ -0,0 +1,33 @@
+#pragma once
+#include "impl/numeric.hpp"
+
+// Filter and controller constants, shared with the host tools in sim/
+namespace tuning {
+// Numeric type the filters and the PIDs run in. Stays float until
+// gaggico_bench shows Q16_16 pays for itself on the RP2040, which has no FPU.
+using Number = float;
+
+struct FilterParams {
+    float err_measure;
+    float err_estimate;
+    float q;
+};
+
+struct PIDParams {
+    float kP;
+    float kI;
+    float kD;
+};
+
+constexpr FilterParams PRESSURE_FILTER {0.6, 0.6, 0.1};
+constexpr FilterParams TEMP_FILTER {0.5, 0.5, 0.3};
+constexpr PIDParams HEATER_PID {0.087, 0.00383, 0.49416};
+constexpr PIDParams PRESSURE_PID {0.5, 0.5, 0.03};
+constexpr float PRESSURE_RAMP_BAR_PER_S = 4;
+
+// Factors on the heater PID gains for each control::HeaterGains set
+constexpr PIDParams HEATER_GAIN_SCALES[] = {
+    {1, 1, 1}, // Standby
+    {1, 0.5, 1}, // Brew, the feedforward carries most of the load
+};
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include "control/control.hpp"
+#include "calibration.hpp"
+#include "network.hpp"
+#include "network/messages.hpp"
+
+// Predicts the weight still coming after the pump stops, so a shot can stop
+// early enough to land on its target. The drip is the weight rate over the
+// last second times a lag, which is learned from how much each shot gained
+// between its stop and the cup settling.
+class WeightStop {
+    static constexpr u32 WINDOW = control::FLOW_RATE_HZ; // One second of weights
+    static constexpr float MIN_STOP_RATE = 0.5; // g/s, slower stops don't show the lag
+    static constexpr float SETTLED_RATE = 0.1; // g/s
+    static constexpr u32 SETTLED_UPDATES = control::FLOW_RATE_HZ;
+    static constexpr u32 MAX_SETTLE_UPDATES = 15 * control::FLOW_RATE_HZ;
+    static constexpr float CUP_LIFTED = 1; // g below the weight at the stop
+    static constexpr float LAG_SMOOTHING = 0.5; // Share of the last shot in the learned lag
+    static constexpr float MAX_LAG = 5; // s
+
+    float weights[WINDOW] {};
+    u32 weight_count = 0;
+    float weight_rate = 0;
+
+    bool settling = false;
+    float target = 0;
+    float stop_weight = 0;
+    float stop_rate = 0;
+    u32 settle_updates = 0;
+    u32 settled_updates = 0;
+    control::WeightLanding last_landing {};
+
+    // Least squares slope over the window
+    float window_rate() const {
+        if (weight_count < WINDOW) return 0;
+        constexpr float MID = (WINDOW - 1) / 2.f;
+        float sum = 0, square_sum = 0;
+        for (u32 i = 0; i < WINDOW; i++) {
+            float x = i - MID;
+            sum += x * weights[(weight_count + i) % WINDOW]; // Oldest first
+            square_sum += x * x;
+        }
+        return sum / square_sum * control::FLOW_RATE_HZ;
+    }
+
+    void settled(float weight) {
+        settling = false;
+        float lag = calibration::get().drip_lag;
+        weight += fmaxf(weight_rate, 0) * lag; // The tail still dripping
+        last_landing = {target, weight, target > 0 ? weight - target : 0, lag};
+        if (target > 0) {
+            printf("Weight stop: landed at %.1f g for %.1f g, %+.1f g\n", weight, target, weight - target);
+        }
+        if (stop_rate >= MIN_STOP_RATE) learn_lag(weight, lag);
+        network::enqueue_message(WeightLandingMessage::from(last_landing));
+    }
+
+    void learn_lag(float weight, float lag) {
+        float shot_lag = (weight - stop_weight) / stop_rate;
+        float new_lag = std::clamp(lag + (shot_lag - lag) * LAG_SMOOTHING, 0.f, MAX_LAG);
+        printf("Weight stop: %.1f g drip at %.2f g/s, drip lag %.2f s from %.2f s\n",
+               weight - stop_weight, stop_rate, new_lag, lag);
+        last_landing.drip_lag = new_lag;
+
+        Calibration new_calibration = calibration::get();
+        new_calibration.drip_lag = new_lag;
+        calibration::update(new_calibration);
+    }
+
+public:
+    // Called after every flow update
+    void update(const control::Sensors& sensors) {
+        if (std::isnan(sensors.weight)) {
+            weight_count = 0;
+            weight_rate = 0;
+            settling = false;
+            return;
+        }
+        weights[weight_count++ % WINDOW] = sensors.weight;
+        weight_rate = window_rate();
+        if (!settling) return;
+
+        if (sensors.weight < stop_weight - CUP_LIFTED) {
+            settling = false;
+            printf("Weight stop: cup lifted before it settled\n");
+            return;
+        }
+        settled_updates = fabsf(weight_rate) < SETTLED_RATE ? settled_updates + 1 : 0;
+        if (settled_updates >= SETTLED_UPDATES || ++settle_updates >= MAX_SETTLE_UPDATES) {
+            settled(sensors.weight);
+        }
+    }
+
+    float drip() const {
+        return fmaxf(weight_rate, 0) * calibration::get().drip_lag;
+    }
+
+    // The pump stopped with `weight` in the cup, `target_weight` is 0 for
+    // shots without one
+    void stopped(float weight, float target_weight) {
+        settling = true;
+        target = target_weight;
+        stop_weight = weight;
+        stop_rate = weight_rate;
+        settle_updates = 0;
+        settled_updates = 0;
+    }
+
+    const control::WeightLanding& landing() const {
+        return last_landing;
+    }
+};
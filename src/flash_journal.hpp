@@ -0,0 +1,117 @@
+#pragma once
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <hardware/flash.h>
+#include "hardware/hardware.hpp"
+#include "inttypes.hpp"
+
+// Journal of page sized records spread over several sectors. Every save
+// programs the next free page and a sector is only erased once the journal
+// wraps around to it, the newest valid record is found by its sequence
+// number on boot.
+class FlashJournal {
+public:
+    static constexpr u32 PAGES_PER_SECTOR = FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE;
+    static constexpr usize MAGIC_SIZE = 8;
+
+    template<typename T>
+    struct Record {
+        char magic[MAGIC_SIZE];
+        u32 version;
+        u32 sequence;
+        T data;
+        u32 crc;
+    };
+
+private:
+    const char* name;
+    u32 offset;
+    u32 page_count;
+    const char* magic;
+    u32 last_sequence = 0;
+    u32 last_page;
+
+    static u32 crc32(const u8* data, usize len) {
+        u32 crc = 0xFFFFFFFF;
+        for (usize i = 0; i < len; i++) {
+            crc ^= data[i];
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+            }
+        }
+        return ~crc;
+    }
+
+    bool is_page_erased(u32 page) const {
+        const u8* ptr = page_ptr(page);
+        for (usize i = 0; i < FLASH_PAGE_SIZE; i++) {
+            if (ptr[i] != 0xFF) return false;
+        }
+        return true;
+    }
+
+public:
+    // `magic` tells the journals apart, it has MAGIC_SIZE characters
+    FlashJournal(const char* name, u32 offset, u32 sectors, const char* magic)
+        : name(name), offset(offset), page_count(sectors * PAGES_PER_SECTOR), magic(magic),
+          last_page(page_count - 1) {}
+
+    u32 pages() const {
+        return page_count;
+    }
+
+    const u8* page_ptr(u32 page) const {
+        return reinterpret_cast<const u8*>(XIP_BASE + offset + page * FLASH_PAGE_SIZE);
+    }
+
+    // Reads the record in `page` if it is valid and has `version`
+    template<typename T>
+    bool read(u32 page, u32 version, Record<T>& record) const {
+        memcpy(&record, page_ptr(page), sizeof(record));
+        return !memcmp(record.magic, magic, MAGIC_SIZE) &&
+               record.version == version &&
+               record.crc == crc32(reinterpret_cast<const u8*>(&record), offsetof(Record<T>, crc));
+    }
+
+    // Remembers the newest record found while scanning the journal on boot,
+    // appends continue after it
+    void found(u32 page, u32 sequence) {
+        last_page = page;
+        last_sequence = sequence;
+    }
+    u32 sequence() const {
+        return last_sequence;
+    }
+
+    template<typename T>
+    void append(u32 version, const T& data) {
+        static_assert(sizeof(Record<T>) <= FLASH_PAGE_SIZE, "A journal record must fit a page");
+        u8 buffer[FLASH_PAGE_SIZE];
+        memset(buffer, 0xFF, sizeof(buffer));
+
+        Record<T> record;
+        memcpy(record.magic, magic, MAGIC_SIZE);
+        record.version = version;
+        record.sequence = last_sequence + 1;
+        record.data = data;
+        record.crc = crc32(reinterpret_cast<const u8*>(&record), offsetof(Record<T>, crc));
+        memcpy(buffer, &record, sizeof(record));
+
+        // Skip pages left behind by an interrupted write, a new sector is
+        // erased before its first page gets used
+        u32 page = (last_page + 1) % page_count;
+        while (page % PAGES_PER_SECTOR != 0 && !is_page_erased(page)) {
+            page = (page + 1) % page_count;
+        }
+        bool erase = page % PAGES_PER_SECTOR == 0;
+
+        // A page program pauses control for under 3 ms, erasing a sector takes
+        // typically 45 ms with 400 ms as the flash's worst case
+        u32 pause_us = hardware::write_flash(offset + page * FLASH_PAGE_SIZE, buffer, FLASH_PAGE_SIZE, erase);
+        printf("%s saved to page %u, control paused for %u us\n", name,
+               static_cast<unsigned>(page), static_cast<unsigned>(pause_us));
+
+        found(page, record.sequence);
+    }
+};
@@ -1,12 +1,22 @@
 #include "hardware.hpp"
 #include <cstdio>
 #include <cmath>
+#include <iterator>
 #include <hardware/gpio.h>
 #include <hardware/spi.h>
 #include <hardware/adc.h>
+#include <hardware/dma.h>
+#include <hardware/flash.h>
+#include <hardware/irq.h>
 #include <hardware/pio.h>
+#include <hardware/structs/sio.h>
+#include <hardware/structs/timer.h>
+#include <hardware/timer.h>
+#include <pico/multicore.h>
 #include <pico/sync.h>
 #include <pico/time.h>
+#include "control/impl/seqlock.hpp"
+#include "hardware/temp_sensor.hpp"
 #include "hardware/thermal_runaway.hpp"
 #include "hx711.pio.h"
 #include "config.hpp"
@@ -18,10 +28,15 @@ using namespace hardware;
 constexpr auto TEMP_CS_PIN = 5;
 constexpr auto TEMP_SCK_PIN = 2;
 constexpr auto TEMP_MISO_PIN = 4;
+constexpr auto TEMP_MOSI_PIN = 3;
 #define TEMP_SPI spi0
-constexpr auto TEMP_READ_INTERVAL = 250;
+constexpr u32 TEMP_FAULT_READS = 3; // Consecutive faulty reads before giving up
+constexpr float TEMP_MAX = 300;
 
 constexpr auto PRESSURE_PIN = 26;
+constexpr auto PRESSURE_SAMPLE_RATE_HZ = 6400;
+constexpr auto PRESSURE_OVERSAMPLING = 64; // Averaged down to 100 Hz
+#define PRESSURE_DMA_IRQ DMA_IRQ_1
 
 constexpr auto ZERO_CROSS_PIN = 7;
 constexpr auto HEAT_DIM_PIN = 8;
@@ -43,12 +58,35 @@ constexpr auto SCALE_MULT_R = -2273.f;
 constexpr auto SCALE_TARE_STEPS = 5;
 
 static absolute_time_t switch_transition_time[3] = {nil_time};
-static absolute_time_t next_temp_read_time = nil_time;
-static critical_section_t temp_cs;
+using TempSensor = TEMP_SENSOR;
+static_assert(TEMP_READ_INTERVAL_MS >= TempSensor::CONVERSION_MS, "Temperature read faster than the sensor converts");
+static TempSensor temp_sensor(TEMP_SPI, TEMP_CS_PIN);
+
+// A repeating timer starts a frame, two DMA channels clock it through the
+// SPI and the RX completion IRQ decodes it and publishes the sample, so
+// reading the temperature never touches the SPI
+static repeating_timer_t temp_timer;
+static uint temp_dma_tx;
+static uint temp_dma_rx;
+static dma_channel_config temp_tx_config;
+static dma_channel_config temp_rx_config;
+static TempSensor::Word temp_frame[TempSensor::FRAME_WORDS];
+static const TempSensor::Word temp_zero = 0;
+static absolute_time_t temp_frame_time = nil_time;
+static SeqLock<TempSample> temp_sample;
+static volatile u32 temp_faults = 0;
+static volatile u32 temp_fault_reads = 0;
 static PSM pump_psm(PUMP_DIM_PIN, 100);
 static PSM heater_psm(HEAT_DIM_PIN, 100);
 static ThermalRunawayCheck thermal_check;
 
+// The ADC runs continuously, two chained DMA channels take turns filling
+// the two buffers and each completed buffer gets averaged in the DMA IRQ
+static u16 pressure_buffers[2][PRESSURE_OVERSAMPLING];
+static uint pressure_dma[2];
+static volatile u32 pressure_sum;
+static volatile absolute_time_t pressure_time = nil_time;
+
 static struct ScaleState {
     i32 offset_l;
     i32 offset_r;
@@ -61,6 +99,11 @@ static struct ScaleState {
     bool connected = false;
 } scale_state;
 
+// Set by core 1 while it programs the flash, core 0 parks in RAM meanwhile
+static volatile bool flash_pause_requested = false;
+static volatile bool flash_pause_active = false;
+static volatile u32 flash_pause_us = 0;
+
 static void gpio_irq_handler(uint gpio, uint32_t event_mask) {
     if (gpio >= SWITCH_PIN_BASE && gpio < SWITCH_PIN_BASE + 3) {
         int which = gpio - SWITCH_PIN_BASE;
@@ -72,26 +115,189 @@ static void gpio_irq_handler(uint gpio, uint32_t event_mask) {
     }
 }
 
+static void pressure_dma_handler() {
+    for (int i = 0; i < 2; ++i) {
+        uint channel = pressure_dma[i];
+        if (!dma_channel_get_irq1_status(channel)) continue;
+        dma_channel_acknowledge_irq1(channel);
 
-void hardware::init() {
-    // Temp sensor
+        u32 sum = 0;
+        for (u16 sample : pressure_buffers[i]) {
+            sum += sample;
+        }
+        pressure_sum = sum;
+        pressure_time = get_absolute_time();
+
+        // The transfer count reloads on trigger, only the address has to be rewound
+        dma_channel_set_write_addr(channel, pressure_buffers[i], false);
+    }
+}
+
+static bool start_temp_frame(repeating_timer_t*) {
+    if (dma_channel_is_busy(temp_dma_rx)) return true;
+
+    const TempSensor::Word* tx;
+    usize words = temp_sensor.next_frame(tx);
+    dma_channel_config tx_config = temp_tx_config;
+    channel_config_set_read_increment(&tx_config, tx != nullptr);
+
+    temp_frame_time = get_absolute_time();
+    temp_sensor.select();
+    dma_channel_configure(temp_dma_rx, &temp_rx_config, temp_frame, &spi_get_hw(TEMP_SPI)->dr, words, true);
+    dma_channel_configure(temp_dma_tx, &tx_config, &spi_get_hw(TEMP_SPI)->dr, tx ? tx : &temp_zero, words, true);
+    return true;
+}
+
+static void temp_dma_handler() {
+    if (!dma_channel_get_irq1_status(temp_dma_rx)) return;
+    dma_channel_acknowledge_irq1(temp_dma_rx);
+    temp_sensor.deselect();
+
+    TempReading reading;
+    if (!temp_sensor.decode_frame(temp_frame, reading)) return;
+    if (!reading.faults && (reading.temperature <= 0 || reading.temperature > TEMP_MAX)) {
+        reading.faults = TEMP_FAULT_OUT_OF_RANGE;
+    }
+    temp_faults = reading.faults;
+
+    // A bad frame keeps the last sample, check_thermals gives up on a
+    // sensor that stays faulty
+    if (reading.faults) {
+        temp_fault_reads = temp_fault_reads + 1;
+        return;
+    }
+    temp_fault_reads = 0;
+    temp_sample.write({reading.temperature, temp_frame_time});
+}
+
+// Runs from RAM with core 0's interrupts off, so no handler runs until core
+// 1 is done, the switch edges stay latched for the flash resident GPIO
+// dispatcher. The dimmers keep switching on the polled zero crossings at
+// their last set power meanwhile.
+static void __not_in_flash_func(hold_outputs)() {
+    u32 start = timer_hw->timerawl;
+    bool last_zero_cross = true;
+    flash_pause_active = true;
+    __dmb();
+
+    while (flash_pause_requested) {
+        bool zero_cross = sio_hw->gpio_in & (1u << ZERO_CROSS_PIN);
+        if (zero_cross && !last_zero_cross) {
+            pump_psm.zero_crossing_handler();
+            heater_psm.zero_crossing_handler();
+        }
+        last_zero_cross = zero_cross;
+    }
+
+    flash_pause_us = timer_hw->timerawl - start;
+    __dmb();
+    flash_pause_active = false;
+}
+
+static void temp_init() {
     spi_init(TEMP_SPI, 3'000'000);
-    spi_set_format(TEMP_SPI, 16, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
     gpio_set_function(TEMP_SCK_PIN, GPIO_FUNC_SPI);
     gpio_set_function(TEMP_MISO_PIN, GPIO_FUNC_SPI);
+    if (TempSensor::USES_MOSI) {
+        gpio_set_function(TEMP_MOSI_PIN, GPIO_FUNC_SPI);
+    }
+    temp_sensor.init();
+
+    constexpr auto data_size = sizeof(TempSensor::Word) == 2 ? DMA_SIZE_16 : DMA_SIZE_8;
+    temp_dma_tx = dma_claim_unused_channel(true);
+    temp_dma_rx = dma_claim_unused_channel(true);
+    temp_tx_config = dma_channel_get_default_config(temp_dma_tx);
+    channel_config_set_transfer_data_size(&temp_tx_config, data_size);
+    channel_config_set_write_increment(&temp_tx_config, false);
+    channel_config_set_dreq(&temp_tx_config, spi_get_dreq(TEMP_SPI, true));
+    temp_rx_config = dma_channel_get_default_config(temp_dma_rx);
+    channel_config_set_transfer_data_size(&temp_rx_config, data_size);
+    channel_config_set_read_increment(&temp_rx_config, false);
+    channel_config_set_write_increment(&temp_rx_config, true);
+    channel_config_set_dreq(&temp_rx_config, spi_get_dreq(TEMP_SPI, false));
+    dma_channel_set_irq1_enabled(temp_dma_rx, true);
+    irq_add_shared_handler(PRESSURE_DMA_IRQ, temp_dma_handler,
+                           PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(PRESSURE_DMA_IRQ, true);
+
+    // The first sample is there before anything asks for it
+    start_temp_frame(nullptr);
+    while (dma_channel_is_busy(temp_dma_rx)) tight_loop_contents();
+    add_repeating_timer_ms(-TEMP_READ_INTERVAL_MS, start_temp_frame, nullptr, &temp_timer);
+}
 
-    gpio_init(TEMP_CS_PIN);
-    gpio_set_dir(TEMP_CS_PIN, GPIO_OUT);
-    gpio_put(TEMP_CS_PIN, 1);
+// A flash write keeps core 0's interrupts off for up to a sector erase, far
+// longer than a buffer takes to fill. Without the IRQ rewinding them the
+// chained channels would write past the buffers, so the ADC stops instead.
+static void pressure_pause() {
+    adc_run(false);
+    while (!(adc_hw->cs & ADC_CS_READY_BITS)) tight_loop_contents();
+
+    // Aborting can raise a completion IRQ (RP2040-E13)
+    u32 mask = (1u << pressure_dma[0]) | (1u << pressure_dma[1]);
+    for (uint channel : pressure_dma) {
+        dma_channel_set_irq1_enabled(channel, false);
+    }
+    dma_hw->abort = mask;
+    while (dma_hw->abort & mask) tight_loop_contents();
+    for (uint channel : pressure_dma) {
+        dma_channel_acknowledge_irq1(channel);
+        dma_channel_set_irq1_enabled(channel, true);
+    }
+    adc_fifo_drain();
+}
 
-    critical_section_init(&temp_cs);
+// Starts over with the first buffer, the last published sum stays valid
+static void pressure_resume() {
+    for (int i = 0; i < 2; ++i) {
+        dma_channel_set_write_addr(pressure_dma[i], pressure_buffers[i], false);
+        dma_channel_set_trans_count(pressure_dma[i], PRESSURE_OVERSAMPLING, false);
+    }
+    dma_channel_start(pressure_dma[0]);
+    adc_run(true);
+}
 
-    // Pressure sensor
+static void pressure_init() {
     adc_init();
     adc_gpio_init(PRESSURE_PIN);
     adc_select_input(PRESSURE_PIN - 26);
     static_assert(PRESSURE_PIN >= 26 && PRESSURE_PIN <= 29, "ADC only on pins 26-29");
 
+    // Seed the value so reads before the first completed buffer are valid
+    pressure_sum = adc_read() * PRESSURE_OVERSAMPLING;
+    pressure_time = get_absolute_time();
+
+    adc_fifo_setup(true, true, 1, false, false);
+    adc_set_clkdiv(48'000'000 / PRESSURE_SAMPLE_RATE_HZ - 1);
+
+    pressure_dma[0] = dma_claim_unused_channel(true);
+    pressure_dma[1] = dma_claim_unused_channel(true);
+    for (int i = 0; i < 2; ++i) {
+        dma_channel_config config = dma_channel_get_default_config(pressure_dma[i]);
+        channel_config_set_transfer_data_size(&config, DMA_SIZE_16);
+        channel_config_set_read_increment(&config, false);
+        channel_config_set_write_increment(&config, true);
+        channel_config_set_dreq(&config, DREQ_ADC);
+        channel_config_set_chain_to(&config, pressure_dma[1 - i]);
+        dma_channel_configure(pressure_dma[i], &config, pressure_buffers[i],
+                              &adc_hw->fifo, PRESSURE_OVERSAMPLING, false);
+        dma_channel_set_irq1_enabled(pressure_dma[i], true);
+    }
+    irq_add_shared_handler(PRESSURE_DMA_IRQ, pressure_dma_handler,
+                           PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(PRESSURE_DMA_IRQ, true);
+
+    dma_channel_start(pressure_dma[0]);
+    adc_run(true);
+}
+
+void hardware::init() {
+    // Temp sensor
+    temp_init();
+
+    // Pressure sensor
+    pressure_init();
+
     // Dimmers
     set_heater(0);
     set_pump(0);
@@ -125,12 +331,66 @@ void hardware::init() {
     irq_set_enabled(IO_IRQ_BANK0, true);
 }
 
+void hardware::flash_pause_point() {
+    if (!flash_pause_requested) return;
+    u32 save = save_and_disable_interrupts();
+    pressure_pause();
+    hold_outputs();
+    pressure_resume();
+    restore_interrupts(save);
+}
+
+u32 hardware::write_flash(u32 offset, const u8* data, usize size, bool erase_sector) {
+    bool pause_core0 = get_core_num() == 1;
+    bool locked_out = false;
+    u32 save = save_and_disable_interrupts();
+
+    if (pause_core0) {
+        flash_pause_requested = true;
+        while (!flash_pause_active) tight_loop_contents();
+    } else if (multicore_lockout_victim_is_initialized(1)) {
+        locked_out = true;
+        multicore_lockout_start_blocking();
+    }
+
+    u64 start = time_us_64();
+    if (erase_sector) {
+        flash_range_erase(offset, FLASH_SECTOR_SIZE);
+    }
+    flash_range_program(offset, data, size);
+    u32 duration = time_us_64() - start;
+
+    if (pause_core0) {
+        flash_pause_requested = false;
+        while (flash_pause_active) tight_loop_contents();
+        __dmb();
+        duration = flash_pause_us;
+    } else if (locked_out) {
+        multicore_lockout_end_blocking();
+    }
+    restore_interrupts(save);
+    return duration;
+}
+
 void hardware::set_heater(float val) {
     heater_psm.set(val * 100);
 }
 
+static void log_temp_faults(u32 faults);
+static Error temp_fault_error(u32 faults);
+
 void hardware::check_thermals() {
-    if (thermal_check.has_fault(heater_psm.set_value, pump_psm.set_value, read_temp())) {
+    static u32 logged_faults = 0;
+    u32 faults = temp_faults;
+    if (faults != logged_faults) {
+        log_temp_faults(faults);
+        logged_faults = faults;
+    }
+    if (temp_fault_reads >= TEMP_FAULT_READS) {
+        panic(temp_fault_error(faults));
+    }
+
+    if (thermal_check.has_fault(heater_psm.set_value, pump_psm.set_value, read_temp().temperature)) {
         panic(Error::THERMAL_RUNAWAY);
     }
 }
@@ -149,46 +409,48 @@ void hardware::set_solenoid(bool active) {
     gpio_put(SOLENOID_PIN, active);
 }
 
-float hardware::read_temp() {
-#ifdef DEBUG_NO_HARDWARE
-    return 30;
-#else
-    critical_section_enter_blocking(&temp_cs);
-
-    static float last_value = 0;
-
-    if (!time_reached(next_temp_read_time)) {
-        critical_section_exit(&temp_cs);
-        return last_value;
+static void log_temp_faults(u32 faults) {
+    static constexpr const char* names[] = {
+        "open", "short to GND", "short to VCC", "RTD high", "RTD low",
+        "reference", "over/undervoltage", "no response", "out of range",
+    };
+    if (!faults) {
+        printf("Temperature sensor faults cleared\n");
+        return;
     }
-    next_temp_read_time = make_timeout_time_ms(TEMP_READ_INTERVAL);
-
-    gpio_put(TEMP_CS_PIN, 0);
-    asm volatile("nop \n nop \n nop");
-
-    uint16_t data;
-    spi_read16_blocking(TEMP_SPI, 0, &data, 1);
-    data >>= 3;
+    printf("Temperature sensor faults:");
+    for (usize i = 0; i < std::size(names); i++) {
+        if (faults & (1 << i)) printf(" %s", names[i]);
+    }
+    printf("\n");
+}
 
-    asm volatile("nop \n nop \n nop");
-    gpio_put(TEMP_CS_PIN, 1);
+static Error temp_fault_error(u32 faults) {
+    if (faults & TEMP_FAULT_OPEN) return Error::TEMP_SENSOR_OPEN;
+    if (faults & (TEMP_FAULT_SHORT_GND | TEMP_FAULT_SHORT_VCC)) return Error::TEMP_SENSOR_SHORT;
+    return Error::SENSOR_ERROR;
+}
 
-    if (data == 0) {
-        panic(Error::SENSOR_ERROR);
-    }
-    last_value = data * 0.25;
-    if (last_value > 300) {
-        panic(Error::SENSOR_ERROR);
-    }
-    critical_section_exit(&temp_cs);
-    return last_value;
+TempSample hardware::read_temp() {
+#ifdef DEBUG_NO_HARDWARE
+    return {30, get_absolute_time()};
+#else
+    return temp_sample.read();
 #endif
 }
 
-float hardware::read_pressure() {
-    uint16_t value = adc_read();
+u32 hardware::get_temp_faults() {
+    return temp_faults;
+}
 
-    return ((float)value - 409.6f) / 273.07f;
+PressureSample hardware::read_pressure() {
+    u32 save = save_and_disable_interrupts();
+    u32 sum = pressure_sum;
+    absolute_time_t time = pressure_time;
+    restore_interrupts(save);
+
+    float value = (float)sum / PRESSURE_OVERSAMPLING;
+    return {(value - 409.6f) / 273.07f, time};
 }
 
 float hardware::read_weight() {
@@ -243,6 +505,21 @@ bool hardware::get_switch(Switch which) {
     return last_state[which];
 }
 
+// get_switch only reads a pin once the GPIO IRQ saw an edge on it and the
+// debounce time passed, otherwise this is three time checks
+u32 hardware::get_switch_changes() {
+    static bool last_state[3] = {false};
+    u32 changes = 0;
+    for (int i = 0; i < 3; i++) {
+        bool state = get_switch(static_cast<Switch>(i));
+        if (state != last_state[i]) {
+            last_state[i] = state;
+            changes |= 1 << i;
+        }
+    }
+    return changes;
+}
+
 bool hardware::is_power_just_pressed() {
     static bool last_pressed = false;
     bool curr_pressed = get_switch(Power);
@@ -1,11 +1,22 @@
 #pragma once
 
+#include <pico/time.h>
 #include "inttypes.hpp"
 namespace hardware {
 enum Switch {
     Power, Brew, Steam,
 };
 
+struct PressureSample {
+    float pressure;
+    absolute_time_t time;
+};
+
+struct TempSample {
+    float temperature;
+    absolute_time_t time;
+};
+
 void init();
 void set_heater(float val);
 void check_thermals();
@@ -14,12 +25,22 @@ u32 get_and_reset_pump_clicks();
 void set_solenoid(bool active);
 void set_light(Switch which, bool active);
 bool get_switch(Switch which);
-float read_pressure();
-float read_temp();
+// Bit per switch whose debounced state changed since the last call
+u32 get_switch_changes();
+PressureSample read_pressure();
+// Latest sample, taken every TEMP_READ_INTERVAL_MS in the background
+TempSample read_temp();
+// TEMP_FAULT_* bits of the last temperature read
+u32 get_temp_faults();
 float read_weight();
 void scale_start_tare();
 void scale_tare_immediately();
 bool is_scale_connected();
 bool is_scale_taring();
 bool is_power_just_pressed();
+
+// Called by core 0 once per loop, parks it in RAM while core 1 writes flash
+void flash_pause_point();
+// Returns how long the control loop was paused in us
+u32 write_flash(u32 offset, const u8* data, usize size, bool erase_sector);
 }
@@ -1,10 +1,14 @@
 #pragma once
 #include <pico/time.h>
 #include <hardware/gpio.h>
+#include <hardware/structs/sio.h>
+#include <hardware/structs/timer.h>
 #include "inttypes.hpp"
 
+// The zero crossing handler runs from RAM and only touches registers
+// directly, so it keeps working while the flash is being programmed
 struct PSM {
-    absolute_time_t next_update_time;
+    u32 next_update_us = 0;
 
     i32 accumulator = 0;
     i32 max_value;
@@ -23,10 +27,11 @@ struct PSM {
         gpio_put(control_pin, false);
     }
 
-    void zero_crossing_handler() {
-        if (!time_reached(next_update_time))
+    void __not_in_flash_func(zero_crossing_handler)() {
+        u32 now = timer_hw->timerawl;
+        if (static_cast<i32>(now - next_update_us) < 0)
             return;
-        next_update_time = make_timeout_time_ms(6);
+        next_update_us = now + 6000;
 
         if (divider_counter < 1) {
             divider_counter++;
@@ -37,10 +42,10 @@ struct PSM {
         accumulator += set_value;
         if (accumulator >= max_value) {
             accumulator -= max_value;
-            gpio_put(control_pin, true);
+            sio_hw->gpio_set = 1u << control_pin;
             counter += 1;
         } else {
-            gpio_put(control_pin, false);
+            sio_hw->gpio_clr = 1u << control_pin;
         }
     }
 
@@ -0,0 +1,214 @@
+#pragma once
+#include <cmath>
+#include <hardware/gpio.h>
+#include <hardware/spi.h>
+#include "inttypes.hpp"
+
+// Boiler temperature sensor drivers, the one in use is picked with
+// TEMP_SENSOR in config.hpp. Faults of all the chips are mapped onto the
+// same bits so the rest of the firmware doesn't care which one is fitted.
+// Reads are done by DMA, a driver only says which words to clock out for
+// the next frame and decodes the words that came back.
+namespace hardware {
+constexpr u32 TEMP_FAULT_OPEN = 1 << 0; // Thermocouple or RTD not connected
+constexpr u32 TEMP_FAULT_SHORT_GND = 1 << 1;
+constexpr u32 TEMP_FAULT_SHORT_VCC = 1 << 2;
+constexpr u32 TEMP_FAULT_RTD_HIGH = 1 << 3; // RTD resistance above the high threshold
+constexpr u32 TEMP_FAULT_RTD_LOW = 1 << 4; // RTD resistance below the low threshold
+constexpr u32 TEMP_FAULT_REFERENCE = 1 << 5; // Reference resistor voltage out of range
+constexpr u32 TEMP_FAULT_VOLTAGE = 1 << 6; // Over or undervoltage on the inputs
+constexpr u32 TEMP_FAULT_NO_RESPONSE = 1 << 7; // All zero frame, nothing answered
+constexpr u32 TEMP_FAULT_OUT_OF_RANGE = 1 << 8; // Valid frame, but not a boiler temperature
+
+struct TempReading {
+    float temperature;
+    u32 faults;
+};
+}
+
+// Chip select with the setup and hold times the MAX chips need around it
+class TempSensorSpi {
+protected:
+    spi_inst_t* spi;
+    u32 cs_pin;
+
+    TempSensorSpi(spi_inst_t* spi, u32 cs_pin) : spi(spi), cs_pin(cs_pin) {}
+
+    void init_cs() {
+        gpio_init(cs_pin);
+        gpio_set_dir(cs_pin, GPIO_OUT);
+        gpio_put(cs_pin, 1);
+    }
+
+public:
+    void select() {
+        gpio_put(cs_pin, 0);
+        asm volatile("nop \n nop \n nop");
+    }
+    void deselect() {
+        asm volatile("nop \n nop \n nop");
+        gpio_put(cs_pin, 1);
+    }
+};
+
+// K thermocouple, 12 bit, 0.25 °C steps, the read starts the next conversion
+class Max6675 : public TempSensorSpi {
+public:
+    using Word = u16;
+    static constexpr usize FRAME_WORDS = 1;
+    static constexpr u32 CONVERSION_MS = 220;
+    static constexpr bool USES_MOSI = false;
+    static constexpr float RESOLUTION = 0.25;
+
+    Max6675(spi_inst_t* spi, u32 cs_pin) : TempSensorSpi(spi, cs_pin) {}
+
+    void init() {
+        spi_set_format(spi, 16, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
+        init_cs();
+    }
+
+    // Null clocks out zeros
+    usize next_frame(const Word*& tx) {
+        tx = nullptr;
+        return FRAME_WORDS;
+    }
+
+    // False if the frame didn't carry a reading
+    bool decode_frame(const Word* rx, hardware::TempReading& reading) {
+        reading = decode(rx[0]);
+        return true;
+    }
+
+    static constexpr hardware::TempReading decode(u16 data) {
+        if (data == 0) return {0, hardware::TEMP_FAULT_NO_RESPONSE};
+        u32 faults = data & (1 << 2) ? hardware::TEMP_FAULT_OPEN : 0;
+        return {(data >> 3) * RESOLUTION, faults};
+    }
+};
+
+// K thermocouple, 14 bit signed, 0.25 °C steps, converts continuously
+class Max31855 : public TempSensorSpi {
+public:
+    using Word = u16;
+    static constexpr usize FRAME_WORDS = 2;
+    static constexpr u32 CONVERSION_MS = 100;
+    static constexpr bool USES_MOSI = false;
+    static constexpr float RESOLUTION = 0.25;
+
+    Max31855(spi_inst_t* spi, u32 cs_pin) : TempSensorSpi(spi, cs_pin) {}
+
+    void init() {
+        spi_set_format(spi, 16, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
+        init_cs();
+    }
+
+    usize next_frame(const Word*& tx) {
+        tx = nullptr;
+        return FRAME_WORDS;
+    }
+
+    bool decode_frame(const Word* rx, hardware::TempReading& reading) {
+        reading = decode(static_cast<u32>(rx[0]) << 16 | rx[1]);
+        return true;
+    }
+
+    static constexpr hardware::TempReading decode(u32 data) {
+        if (data == 0) return {0, hardware::TEMP_FAULT_NO_RESPONSE};
+        u32 faults = 0;
+        if (data & (1 << 16)) {
+            if (data & (1 << 0)) faults |= hardware::TEMP_FAULT_OPEN;
+            if (data & (1 << 1)) faults |= hardware::TEMP_FAULT_SHORT_GND;
+            if (data & (1 << 2)) faults |= hardware::TEMP_FAULT_SHORT_VCC;
+        }
+        i32 raw = static_cast<i32>(data) >> 18; // Sign extends the 14 bits
+        return {raw * RESOLUTION, faults};
+    }
+};
+
+// PT100 RTD, 15 bit ratio to the reference resistor. Runs in auto
+// conversion mode with the 50 Hz filter and needs MOSI wired up. A frame
+// reads everything from the RTD value to the fault status in one burst,
+// after a fault the next frame clears it instead.
+template<bool THREE_WIRE = false>
+class Max31865 : public TempSensorSpi {
+    static constexpr u8 REG_CONFIG = 0x00;
+    static constexpr u8 REG_RTD = 0x01;
+    static constexpr u8 REG_FAULT_STATUS = 0x07;
+    static constexpr u8 WRITE = 0x80;
+
+    static constexpr u8 CONFIG_BIAS = 0x80;
+    static constexpr u8 CONFIG_AUTO = 0x40;
+    static constexpr u8 CONFIG_3_WIRE = 0x10;
+    static constexpr u8 CONFIG_FAULT_CLEAR = 0x02;
+    static constexpr u8 CONFIG_50HZ = 0x01;
+
+    static constexpr float R_REF = 430; // Ohm, 4.3 x R0 like the common breakout boards
+    static constexpr float R0 = 100;
+    // Callendar-Van Dusen coefficients of IEC 60751, good above 0 °C
+    static constexpr float A = 3.9083e-3;
+    static constexpr float B = -5.775e-7;
+
+    static constexpr u8 CONFIG = CONFIG_BIAS | CONFIG_AUTO | CONFIG_50HZ | (THREE_WIRE ? CONFIG_3_WIRE : 0);
+
+    static constexpr u8 READ_FRAME[] = {REG_RTD, 0, 0, 0, 0, 0, 0, 0};
+    static constexpr u8 CLEAR_FRAME[] = {REG_CONFIG | WRITE, CONFIG | CONFIG_FAULT_CLEAR};
+    static_assert(sizeof(READ_FRAME) == 1 + REG_FAULT_STATUS - REG_RTD + 1, "Read frame ends at the fault status");
+
+    bool clearing = false;
+
+public:
+    using Word = u8;
+    static constexpr usize FRAME_WORDS = sizeof(READ_FRAME);
+    static constexpr u32 CONVERSION_MS = 21;
+    static constexpr bool USES_MOSI = true;
+    static constexpr float RESOLUTION = 0.03;
+
+    Max31865(spi_inst_t* spi, u32 cs_pin) : TempSensorSpi(spi, cs_pin) {}
+
+    void init() {
+        spi_set_format(spi, 8, SPI_CPOL_0, SPI_CPHA_1, SPI_MSB_FIRST);
+        init_cs();
+        select();
+        spi_write_blocking(spi, CLEAR_FRAME, sizeof(CLEAR_FRAME));
+        deselect();
+    }
+
+    usize next_frame(const Word*& tx) {
+        tx = clearing ? CLEAR_FRAME : READ_FRAME;
+        return clearing ? sizeof(CLEAR_FRAME) : sizeof(READ_FRAME);
+    }
+
+    bool decode_frame(const Word* rx, hardware::TempReading& reading) {
+        if (clearing) {
+            clearing = false;
+            return false;
+        }
+        // rx[0] came back while the address went out
+        reading = decode(static_cast<u16>(rx[1] << 8 | rx[2]));
+        if (reading.faults & hardware::TEMP_FAULT_NO_RESPONSE) return true;
+
+        // The RTD register only flags a fault, the details are in the status
+        if (rx[2] & 1) {
+            reading.faults |= decode_faults(rx[1 + REG_FAULT_STATUS - REG_RTD]);
+            clearing = true;
+        }
+        return true;
+    }
+
+    static hardware::TempReading decode(u16 data) {
+        if (data == 0) return {0, hardware::TEMP_FAULT_NO_RESPONSE};
+        float resistance = (data >> 1) * R_REF / 32768;
+        float temperature = (-A + sqrtf(A * A - 4 * B * (1 - resistance / R0))) / (2 * B);
+        return {temperature, 0};
+    }
+
+    static constexpr u32 decode_faults(u8 status) {
+        u32 faults = 0;
+        if (status & 0x80) faults |= hardware::TEMP_FAULT_RTD_HIGH;
+        if (status & 0x40) faults |= hardware::TEMP_FAULT_RTD_LOW;
+        if (status & 0x30) faults |= hardware::TEMP_FAULT_REFERENCE;
+        if (status & 0x08) faults |= hardware::TEMP_FAULT_OPEN;
+        if (status & 0x04) faults |= hardware::TEMP_FAULT_VOLTAGE;
+        return faults;
+    }
+};
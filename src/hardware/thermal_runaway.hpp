@@ -22,8 +22,8 @@ struct ThermalRunawayCheck {
 
         if (time_reached(deadline) || temp >= goal_temp) {
             if (temp < goal_temp) {
-                printf("Thermal runaway check failed, temp: %.2f, goal: %.2f, heater: %ld%%, pump: %ld%%\n",
-                       temp, goal_temp, heater_power, pump_power);
+                printf("Thermal runaway check failed, temp: %.2f, goal: %.2f, heater: %d%%, pump: %d%%\n",
+                       temp, goal_temp, static_cast<int>(heater_power), static_cast<int>(pump_power));
                 return true;
             }
             goal_temp = temp + HEATING_GAIN;
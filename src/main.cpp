@@ -6,6 +6,8 @@
 #include "network/network.hpp"
 #include "control/protocol.hpp"
 #include "hardware/hardware.hpp"
+#include "brew_profile.hpp"
+#include "calibration.hpp"
 #include "settings.hpp"
 
 static void core1_entry() {
@@ -21,7 +23,9 @@ static void core1_entry() {
 int main() {
     stdio_init_all();
     multicore_lockout_victim_init();
+    calibration::init();
     settings::init();
+    brew_profile::init();
     hardware::init();
 
     multicore_launch_core1(core1_entry);
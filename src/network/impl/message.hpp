@@ -12,24 +12,23 @@ concept IncomingMsg = requires(T t) {
 };
 
 template <typename Tuple, typename Variant>
-struct handle_impl;
+struct read_msg_impl;
 
 template <IncomingMsg T, IncomingMsg... Ts, typename Variant>
-struct handle_impl<std::variant<T, Ts...>, Variant> {
-    static void handle(int msg_id, Variant& msg, u8*& data) {
+struct read_msg_impl<std::variant<T, Ts...>, Variant> {
+    static void read(int msg_id, Variant& msg, u8*& data) {
         if (msg_id == T::INCOMING_ID) {
             T& t = msg.template emplace<T>();
             read_struct<T>(t, data);
-            t.handle();
         } else {
-            handle_impl<std::variant<Ts...>, Variant>::handle(msg_id, msg, data);
+            read_msg_impl<std::variant<Ts...>, Variant>::read(msg_id, msg, data);
         }
     }
 };
 
 template <typename Variant>
-struct handle_impl<std::variant<>, Variant> {
-    static void handle(int msg_id, Variant& msg, u8*& data) {
+struct read_msg_impl<std::variant<>, Variant> {
+    static void read(int msg_id, Variant& msg, u8*& data) {
         (void) msg_id;
         (void) msg;
         (void) data;
@@ -37,9 +36,13 @@ struct handle_impl<std::variant<>, Variant> {
 };
 
 template <typename Variant>
-void handle_incoming_msg(int msg_id, u8*& data_ptr) {
-    Variant msg;
-    handle_impl<Variant, Variant>::handle(msg_id, msg, data_ptr);
+void read_incoming_msg(int msg_id, Variant& msg, u8*& data_ptr) {
+    read_msg_impl<Variant, Variant>::read(msg_id, msg, data_ptr);
+}
+
+template <typename Variant>
+void handle_incoming_msg(Variant& msg) {
+    std::visit([](auto& msg) { msg.handle(); }, msg);
 }
 
 template <typename T, class=void>
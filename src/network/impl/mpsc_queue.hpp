@@ -0,0 +1,57 @@
+#pragma once
+#include <hardware/platform_defs.h>
+#include <hardware/sync.h>
+#include "inttypes.hpp"
+
+// Bounded single producer, single consumer ring. Only needs ordered loads
+// and stores, so it works without the atomics the M0+ doesn't have.
+template <typename T, usize Capacity>
+class SpscQueue {
+    T data[Capacity + 1];
+    volatile usize front = 0; // Only written by the consumer
+    volatile usize back = 0;  // Only written by the producer
+
+    static constexpr usize next(usize index) {
+        return (index + 1) % (Capacity + 1);
+    }
+
+public:
+    bool try_push(const T& value) {
+        usize curr_back = back;
+        if (next(curr_back) == front) return false;
+        data[curr_back] = value;
+        __dmb();
+        back = next(curr_back);
+        return true;
+    }
+
+    bool try_pop(T& out) {
+        usize curr_front = front;
+        if (curr_front == back) return false;
+        __dmb();
+        out = data[curr_front];
+        __dmb();
+        front = next(curr_front);
+        return true;
+    }
+};
+
+// Multiple producer, single consumer queue made of one lane per core.
+// Each core may only push from a single context, e.g. only from lwIP
+// callbacks on core 1.
+template <typename T, usize CapacityPerCore>
+class MpscQueue {
+    SpscQueue<T, CapacityPerCore> lanes[NUM_CORES];
+
+public:
+    bool try_push(const T& value) {
+        return lanes[get_core_num()].try_push(value);
+    }
+
+    bool try_pop(T& out) {
+        for (auto& lane : lanes) {
+            if (lane.try_pop(out)) return true;
+        }
+        return false;
+    }
+};
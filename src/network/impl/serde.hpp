@@ -31,7 +31,7 @@ inline void write_val(u8*& ptr, T value) {
     } else if constexpr (sizeof(T) == 2) {
         u16 val;
         memcpy(&val, &value, sizeof(value));
-        val = htonl(val);
+        val = htons(val);
         memcpy(ptr, &val, sizeof(val));
         ptr += sizeof(val);
     } else if constexpr (sizeof(T) == 1) {
@@ -51,7 +51,7 @@ inline void read_val(u8*& ptr, T& value) {
         memcpy(&value, &val, sizeof(T));
         ptr += sizeof(T);
     } else if constexpr (sizeof(T) == 2) {
-        u32 val;
+        u16 val;
         memcpy(&val, ptr, sizeof(T));
         val = ntohs(val);
         memcpy(&value, &val, sizeof(T));
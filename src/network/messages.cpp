@@ -3,6 +3,20 @@
 #include "control/states.hpp"
 #include "network.hpp"
 #include "ntp.hpp"
+#include "impl/serde.hpp"
+
+using protocol::TransitionCause;
+
+// A full queue panics, so the status messages beyond the state, settings
+// and profile are left out once it is half full. They are sent again when
+// they change or on the next GetStatus.
+constexpr usize OPTIONAL_STATUS_QUEUE_LIMIT = 10;
+
+static void enqueue_optional_status(const OutMessages& msg) {
+    if (network::message_queue_size() < OPTIONAL_STATUS_QUEUE_LIMIT) {
+        network::enqueue_message(msg);
+    }
+}
 
 void GetStatusMessage::handle() {
     StateChangeMessage msg;
@@ -11,24 +25,35 @@ void GetStatusMessage::handle() {
     msg.state_change_timestamp = ntp::to_timestamp(protocol::state().state_change_time) / 1000;
     network::enqueue_message(msg);
     network::enqueue_message(SettingsGetMessage());
+    network::enqueue_message(BrewProfileMessage());
+    enqueue_optional_status(CalibrationMessage());
+    if (control::weight_landing().weight > 0) {
+        enqueue_optional_status(WeightLandingMessage::from(control::weight_landing()));
+    }
 
     if (protocol::get_state_id() == BackflushState::ID ||
         protocol::get_state_id() == DescaleState::ID) {
-        network::enqueue_message(states::maintenance_msg);
+        enqueue_optional_status(states::maintenance_msg);
+    }
+    if (protocol::get_state_id() == AutotuneState::ID) {
+        enqueue_optional_status(states::autotune_msg);
     }
 }
 
 void MaintenanceMessage::handle() {
     if (protocol::get_state_id() == StandbyState::ID) {
         if (type == 1) { // Backflush
-            protocol::schedule_state_change<BackflushState>();
+            protocol::schedule_state_change<BackflushState>(TransitionCause::Network);
         } else if (type == 2) { // Descale
-            protocol::schedule_state_change<DescaleState>();
+            protocol::schedule_state_change<DescaleState>(TransitionCause::Network);
+        } else if (type == 3) { // Heater PID autotune
+            protocol::schedule_state_change<AutotuneState>(TransitionCause::Network);
         }
     } else if (protocol::get_state_id() == BackflushState::ID ||
-               protocol::get_state_id() == DescaleState::ID) {
+               protocol::get_state_id() == DescaleState::ID ||
+               protocol::get_state_id() == AutotuneState::ID) {
         if (type == 0) { // Stop
-            protocol::schedule_state_change<StandbyState>();
+            protocol::schedule_state_change<StandbyState>(TransitionCause::Network);
         }
     }
 }
@@ -38,8 +63,60 @@ void ManualControlMessage::handle() {
         ManualControlState::target_flow = target_flow;
         ManualControlState::target_pressure = target_pressure;
         ManualControlState::time_ms = time_ms;
-        protocol::schedule_state_change<ManualControlState>();
+        protocol::schedule_state_change<ManualControlState>(TransitionCause::Network);
     } else if (protocol::get_state_id() == ManualControlState::ID) {
-        protocol::schedule_state_change<StandbyState>();
+        protocol::schedule_state_change<StandbyState>(TransitionCause::Network);
+    }
+}
+
+// Written on core 1 from the stats core 0 published when they were asked for
+void TaskStatsMessage::write(u8*& ptr) const {
+    protocol::TaskStatsSnapshot snapshot = protocol::task_stats_snapshot();
+    write_val(ptr, static_cast<u32>(protocol::TASK_COUNT));
+    for (const TaskStats& stats : snapshot.tasks) {
+        write_struct(stats, ptr);
     }
 }
+
+void GetTaskStatsMessage::handle() {
+    protocol::publish_task_stats();
+    network::enqueue_message(TaskStatsMessage());
+}
+
+void ProfileMessage::write(u8*& ptr) const {
+    write_val(ptr, stage);
+    write_val(ptr, profile.total);
+    write_val(ptr, profile.percentile(500));
+    write_val(ptr, profile.percentile(990));
+    write_val(ptr, profile.max);
+    for (u32 count : profile.counts) {
+        write_val(ptr, count);
+    }
+}
+
+void GetProfileMessage::handle() {
+    if (stage >= protocol::PROFILE_STAGE_COUNT) return;
+    // Copied on core 0, core 1 sends it while the histogram keeps filling
+    ProfileMessage msg;
+    msg.stage = stage;
+    msg.profile = protocol::stage_profile(stage);
+    network::enqueue_message(msg);
+}
+
+void TransitionHistoryMessage::write(u8*& ptr) const {
+    protocol::TransitionHistory history = protocol::transition_history();
+    u32 count = std::min<u32>(history.count, protocol::TRANSITION_HISTORY_SIZE);
+    write_val(ptr, count);
+    for (u32 i = history.count - count; i < history.count; i++) {
+        const protocol::Transition& transition = history.entries[i % protocol::TRANSITION_HISTORY_SIZE];
+        write_val(ptr, ntp::to_timestamp(transition.time) / 1000);
+        write_val(ptr, transition.time_in_state_ms);
+        write_val(ptr, transition.old_state);
+        write_val(ptr, transition.new_state);
+        write_val(ptr, static_cast<u32>(transition.cause));
+    }
+}
+
+void GetTransitionHistoryMessage::handle() {
+    network::enqueue_message(TransitionHistoryMessage());
+}
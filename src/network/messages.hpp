@@ -1,6 +1,9 @@
 #pragma once
 #include <variant>
 
+#include "brew_profile.hpp"
+#include "calibration.hpp"
+#include "control/control.hpp"
 #include "control/protocol.hpp"
 #include "inttypes.hpp"
 #include "settings.hpp"
@@ -34,7 +37,83 @@ struct MaintenanceStatusMessage {
     i32 cycle;
 };
 
-using OutMessages = std::variant<StateChangeMessage, SensorStatusMessage, SettingsGetMessage, MaintenanceStatusMessage>;
+struct TaskStatsMessage {
+    static constexpr i32 OUTGOING_ID = 5;
+
+    void write(u8*& ptr) const;
+};
+
+// Cycle histogram of a main loop stage or task, with the stage it is for
+struct ProfileMessage {
+    static constexpr i32 OUTGOING_ID = 6;
+    u32 stage;
+    Histogram profile;
+
+    void write(u8*& ptr) const;
+};
+
+struct AutotuneStatusMessage {
+    static constexpr i32 OUTGOING_ID = 7;
+    i32 stage;
+    i32 cycle;
+    float amplitude;
+    float period;
+    float kp;
+    float ki;
+    float kd;
+};
+
+struct HeaterStatusMessage {
+    static constexpr i32 OUTGOING_ID = 8;
+    u32 gains;
+    float target;
+    float overshoot;
+    float settling_time;
+    float power;
+    float feedforward;
+    u32 temp_faults;
+};
+
+// The transition history, oldest first
+struct TransitionHistoryMessage {
+    static constexpr i32 OUTGOING_ID = 9;
+
+    void write(u8*& ptr) const;
+};
+
+// The uploaded brew profile, no phases when the classic one runs
+struct BrewProfileMessage {
+    static constexpr i32 OUTGOING_ID = 10;
+
+    void write(u8*& ptr) const {
+        brew_profile::uploaded().write_data(ptr);
+    }
+};
+
+// What the machine learned about itself, kept out of the settings
+struct CalibrationMessage {
+    static constexpr i32 OUTGOING_ID = 11;
+
+    void write(u8*& ptr) const {
+        calibration::get().write_data(ptr);
+    }
+};
+
+// Where the cup settled after the last shot that stopped with the scale
+// tared, error is 0 for shots without a target weight
+struct WeightLandingMessage {
+    static constexpr i32 OUTGOING_ID = 12;
+    float target;
+    float weight;
+    float error;
+    float drip_lag; // As learned from this shot
+
+    static WeightLandingMessage from(const control::WeightLanding& landing) {
+        return {landing.target, landing.weight, landing.error, landing.drip_lag};
+    }
+};
+
+using OutMessages = std::variant<StateChangeMessage, SensorStatusMessage, SettingsGetMessage, MaintenanceStatusMessage, TaskStatsMessage, ProfileMessage, AutotuneStatusMessage, HeaterStatusMessage, TransitionHistoryMessage, BrewProfileMessage, CalibrationMessage, WeightLandingMessage>;
 
 struct PowerMessage {
     static constexpr i32 INCOMING_ID = 1;
@@ -80,9 +159,46 @@ struct ManualControlMessage {
     void handle();
 };
 
+struct GetTaskStatsMessage {
+    static constexpr i32 INCOMING_ID = 6;
+    static constexpr u32 SIZE = 0;
+
+    void handle();
+};
+
+struct GetProfileMessage {
+    static constexpr i32 INCOMING_ID = 7;
+    u32 stage;
+
+    void handle();
+};
+
+struct GetTransitionHistoryMessage {
+    static constexpr i32 INCOMING_ID = 8;
+    static constexpr u32 SIZE = 0;
+
+    void handle();
+};
+
+struct BrewProfileUpdateMessage {
+    static constexpr i32 INCOMING_ID = 9;
+    static constexpr u32 SIZE = BrewProfile::DATA_SIZE;
+    BrewProfile profile;
+
+    void read(u8*& ptr) {
+        profile.read_data(ptr);
+    }
+    void handle() {
+        brew_profile::update(profile);
+    }
+};
 
 using InMessages = std::variant<PowerMessage,
                                 SettingsUpdateMessage,
                                 GetStatusMessage,
                                 MaintenanceMessage,
-                                ManualControlMessage>;
+                                ManualControlMessage,
+                                GetTaskStatsMessage,
+                                GetProfileMessage,
+                                GetTransitionHistoryMessage,
+                                BrewProfileUpdateMessage>;
@@ -8,6 +8,7 @@
 #include <variant>
 #include "config.hpp"
 #include "impl/message.hpp"
+#include "impl/mpsc_queue.hpp"
 #include "impl/queue.hpp"
 #include "lwip/err.h"
 #include "messages.hpp"
@@ -26,8 +27,12 @@ using namespace network;
 constexpr auto IN_MESSAGE_BUFFER_CAP = 127;
 static_assert(sizeof(InMessages) < IN_MESSAGE_BUFFER_CAP);
 
-constexpr auto OUT_MESSAGE_BUFFER_CAP = 127;
+constexpr auto OUT_MESSAGE_BUFFER_CAP = 255;
 static_assert(MAX(sizeof(OutMessages), sizeof(Settings) + 4) < OUT_MESSAGE_BUFFER_CAP);
+static_assert(8 + 4 + 4 + sizeof(TaskStats) * protocol::TASK_COUNT < OUT_MESSAGE_BUFFER_CAP, "Task stats must fit into the message buffer");
+static_assert(8 + 4 + 4 * 5 + sizeof(Histogram::counts) < OUT_MESSAGE_BUFFER_CAP, "Profile must fit into the message buffer");
+static_assert(8 + 4 + 4 + 24 * protocol::TRANSITION_HISTORY_SIZE < OUT_MESSAGE_BUFFER_CAP, "Transition history must fit into the message buffer");
+static_assert(4 + BrewProfile::DATA_SIZE < IN_MESSAGE_BUFFER_CAP, "Brew profiles must fit into the message buffer");
 
 constexpr auto ACK_TIMEOUT_MS = 2000;
 constexpr auto CLIENT_CAPACITY = 5;
@@ -49,6 +54,9 @@ static u8 out_message_buffer[OUT_MESSAGE_BUFFER_CAP];
 static isize out_message_len = -1;
 static Queue<OutMessages, 20> out_message_queue;
 
+// Filled from the lwIP callbacks on core 1, handled by the main loop on core 0
+static MpscQueue<InMessages, 8> in_message_queue;
+
 static err_t close_connection(tcp_pcb* pcb) {
     tcp_arg(pcb, nullptr);
     tcp_sent(pcb, nullptr);
@@ -134,7 +142,11 @@ static err_t recv_callback(void* arg, struct tcp_pcb* tpcb, struct pbuf* p, err_
                     msg_sizes<InMessages>[msg_id-1] == msg_len) {
                     u8* msg_data = client.message_buffer + sizeof(msg_id);
                     DEBUG("Received msg %u from %u\n", msg_id, (&client - clients));
-                    handle_incoming_msg<InMessages>(msg_id, msg_data);
+                    InMessages msg;
+                    read_incoming_msg(msg_id, msg, msg_data);
+                    if (!in_message_queue.try_push(msg)) {
+                        printf("Incoming message queue full, dropping message %u\n", msg_id);
+                    }
                 }
             }
         }
@@ -288,6 +300,13 @@ void network::process_outgoing_messages() {
     }
 }
 
+void network::process_incoming_messages() {
+    InMessages msg;
+    while (in_message_queue.try_pop(msg)) {
+        handle_incoming_msg(msg);
+    }
+}
+
 void network::enqueue_message(const OutMessages& msg) {
     if (!out_message_queue.try_push(msg)) {
         panic(Error::MESSAGE_QUEUE_FULL);
@@ -5,6 +5,7 @@ namespace network {
 void wifi_init();
 void server_init();
 void process_outgoing_messages();
+void process_incoming_messages();
 usize message_queue_size();
 void enqueue_message(const OutMessages& msg);
 }
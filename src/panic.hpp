@@ -8,6 +8,9 @@ enum class Error {
     MESSAGE_QUEUE_FULL,
     SD_CARD_ERROR,
     THERMAL_RUNAWAY,
+    TEMP_SENSOR_OPEN,
+    TEMP_SENSOR_SHORT,
+    COROUTINE_POOL_FULL,
 };
 
 [[noreturn]] void panic(Error error);
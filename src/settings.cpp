@@ -1,42 +1,94 @@
 #include "settings.hpp"
+#include <cstddef>
 #include <cstring>
+#include <cstdio>
 #include <hardware/flash.h>
-#include <pico/multicore.h>
+#include <hardware/sync.h>
+#include <pico/time.h>
+#include "flash_journal.hpp"
+#include "hardware/hardware.hpp"
 #include "network.hpp"
 #include "network/messages.hpp"
 #include "network/impl/serde.hpp"
 using namespace settings;
 
 constexpr auto SETTINGS_FLASH_OFFSET = (1024 * 1024);
-constexpr auto SETTINGS_MAGIC = "GAGGICO ";
+constexpr auto SETTINGS_SECTORS = 4;
+constexpr auto LEGACY_SETTINGS_MAGIC = "GAGGICO ";
 constexpr u32 SETTINGS_VERSION = 4;
-const u8* flash_settings = reinterpret_cast<const u8*>(XIP_BASE + SETTINGS_FLASH_OFFSET);
+constexpr auto SAVE_DELAY_MS = 1000; // Coalesces the updates while a slider is dragged
+
+static FlashJournal journal("Settings", SETTINGS_FLASH_OFFSET, SETTINGS_SECTORS, "GAGGICOJ");
+static_assert(sizeof(FlashJournal::Record<Settings>) <= FLASH_PAGE_SIZE, "Settings must be smaller than a page");
+
+// Layout of the settings written before the journal, upgraded on boot
+constexpr u32 LEGACY_SETTINGS_VERSION = 4;
+struct SettingsV4 {
+    float brew_temp;
+    float steam_temp;
+    float brew_pressure;
+    float preinfusion_pressure;
+    float preinfusion_time;
+    float brew_weight;
+    float pump_zero;
+
+    Settings upgrade() const {
+        Settings settings;
+        settings.brew_temp = brew_temp;
+        settings.steam_temp = steam_temp;
+        settings.brew_pressure = brew_pressure;
+        settings.preinfusion_pressure = preinfusion_pressure;
+        settings.preinfusion_time = preinfusion_time;
+        settings.brew_weight = brew_weight;
+        settings.pump_zero = pump_zero;
+        return settings;
+    }
+};
 
 static Settings current_settings;
+// Updated on core 0 and flushed from core 1
+static volatile bool save_pending = false;
+static volatile absolute_time_t save_time = nil_time;
+
+// Settings written before the journal, as a single record in the first page
+static bool read_legacy() {
+    const u8* curr_ptr = journal.page_ptr(0);
+    if (memcmp(LEGACY_SETTINGS_MAGIC, curr_ptr, strlen(LEGACY_SETTINGS_MAGIC))) return false;
+    curr_ptr += strlen(LEGACY_SETTINGS_MAGIC);
+
+    u32 flash_version;
+    memcpy(&flash_version, curr_ptr, sizeof(flash_version));
+    if (flash_version != LEGACY_SETTINGS_VERSION) return false;
+    curr_ptr += sizeof(flash_version);
+
+    SettingsV4 settings;
+    memcpy(&settings, curr_ptr, sizeof(settings));
+    current_settings = settings.upgrade();
+    return true;
+}
 
 void load_default() {
-    Settings default_settings;
-    update(default_settings);
+    current_settings = Settings();
+    journal.append(SETTINGS_VERSION, current_settings);
 }
 
 void settings::init() {
-    const u8* curr_ptr = flash_settings;
-    if (memcmp(SETTINGS_MAGIC, curr_ptr, strlen(SETTINGS_MAGIC))) { // Magic doesn't match
-        load_default();
-        return;
+    bool found = false;
+    FlashJournal::Record<Settings> record;
+    for (u32 page = 0; page < journal.pages(); page++) {
+        if (!journal.read(page, SETTINGS_VERSION, record)) continue;
+        if (found && record.sequence <= journal.sequence()) continue;
+        found = true;
+        journal.found(page, record.sequence);
+        current_settings = record.data;
     }
-    curr_ptr += strlen(SETTINGS_MAGIC);
+    if (found) return;
 
-    u32 flash_version;
-    memcpy(&flash_version, curr_ptr, sizeof(SETTINGS_VERSION));
-    if (flash_version != SETTINGS_VERSION) { // Version doesn't match
-        load_default();
+    if (read_legacy()) {
+        journal.append(SETTINGS_VERSION, current_settings);
         return;
     }
-    curr_ptr += sizeof(SETTINGS_VERSION);
-
-    // Everything matches
-    memcpy(&current_settings, curr_ptr, sizeof(Settings));
+    load_default();
 }
 
 const Settings& settings::get() {
@@ -45,38 +97,21 @@ const Settings& settings::get() {
 
 void settings::update(Settings& new_settings) {
     current_settings = new_settings;
-
-    static_assert(7 + sizeof(SETTINGS_VERSION) + sizeof(Settings) < FLASH_PAGE_SIZE, "Settings must be smaller than a page");
-    u8 buffer[FLASH_PAGE_SIZE];
-    u8* buf_ptr = buffer;
-
-    memcpy(buf_ptr, SETTINGS_MAGIC, strlen(SETTINGS_MAGIC));
-    buf_ptr += strlen(SETTINGS_MAGIC);
-
-    memcpy(buf_ptr, &SETTINGS_VERSION, sizeof(SETTINGS_VERSION));
-    buf_ptr += sizeof(SETTINGS_VERSION);
-
-    memcpy(buf_ptr, &new_settings, sizeof(Settings));
-
-    u32 save = save_and_disable_interrupts();
-
-    bool locked_out = false;
-    if (multicore_lockout_victim_is_initialized(1 - get_core_num())) {
-        locked_out = true;
-        multicore_lockout_start_blocking();
-    }
-
-    flash_range_erase(SETTINGS_FLASH_OFFSET, FLASH_SECTOR_SIZE);
-    flash_range_program(SETTINGS_FLASH_OFFSET, buffer, FLASH_PAGE_SIZE);
-
-    if (locked_out) {
-        multicore_lockout_end_blocking();
-    }
-    restore_interrupts(save);
+    save_time = make_timeout_time_ms(SAVE_DELAY_MS);
+    __dmb();
+    save_pending = true;
 
     network::enqueue_message(SettingsGetMessage());
 }
 
+void settings::flush() {
+    if (!save_pending || !time_reached(save_time)) return;
+    // An update racing the copy below sets this again and gets saved next
+    save_pending = false;
+    __dmb();
+    journal.append(SETTINGS_VERSION, current_settings);
+}
+
 void Settings::write_data(u8*& ptr) const {
     write_struct(*this, ptr);
 }
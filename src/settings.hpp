@@ -18,4 +18,7 @@ namespace settings {
 void init();
 const Settings& get();
 void update(Settings& new_settings);
+// Writes changed settings to flash once they stopped changing for a while,
+// called from core 1 between shots so core 0 can keep the dimmers running
+void flush();
 }
@@ -15,12 +15,25 @@ local enums = {
       "Steam",
       "Backflush",
       "Descale",
+      "Manual Control",
+      "Autotune",
    },
    maintenance_type = {
       [0] = "Stop",
       "Backflush",
       "Descale",
-   }
+      "Autotune",
+   },
+   heater_gains = {
+      [0] = "Standby",
+      "Brew",
+   },
+   autotune_stage = {
+      [0] = "Heating",
+      "Cycling",
+      "Done",
+      "Failed",
+   },
 }
 
 local s2c_messages = {
@@ -41,8 +54,18 @@ local s2c_messages = {
       }
    },
    {
+      -- Learned values are sent in Calibration, the settings are back to
+      -- the fields of version 4 and an update carries only what the user sets
       name = "Settings",
-      fields = {},
+      fields = {
+         field("Brew Temperature", "float"),
+         field("Steam Temperature", "float"),
+         field("Brew Pressure", "float"),
+         field("Preinfusion Pressure", "float"),
+         field("Preinfusion Time", "float"),
+         field("Brew Weight", "float"),
+         field("Pump Zero", "float"),
+      },
    },
    {
       name = "Maintenance Status",
@@ -51,6 +74,78 @@ local s2c_messages = {
          field("Cycle", "int32"),
       }
    },
+   {
+      name = "Task Stats",
+      fields = {
+         field("Task Count", "uint32"),
+      }
+   },
+   {
+      name = "Profile",
+      fields = {
+         field("Stage", "uint32"),
+         field("Samples", "uint32"),
+         field("P50 Cycles", "uint32"),
+         field("P99 Cycles", "uint32"),
+         field("Max Cycles", "uint32"),
+      }
+   },
+   {
+      name = "Autotune Status",
+      fields = {
+         field("Stage", "enum.autotune_stage"),
+         field("Cycle", "int32"),
+         field("Amplitude", "float"),
+         field("Period", "float"),
+         field("kP", "float"),
+         field("kI", "float"),
+         field("kD", "float"),
+      }
+   },
+   {
+      name = "Heater Status",
+      fields = {
+         field("Gains", "enum.heater_gains"),
+         field("Target", "float"),
+         field("Overshoot", "float"),
+         field("Settling Time", "float"),
+         field("Power", "float"),
+         field("Feedforward", "float"),
+         field("Temperature Sensor Faults", "uint32"),
+      }
+   },
+   {
+      name = "Transition History",
+      fields = {
+         field("Transition Count", "uint32"),
+      }
+   },
+   {
+      name = "Brew Profile",
+      fields = {
+         field("Phase Count", "uint32"),
+      }
+   },
+   {
+      name = "Calibration",
+      fields = {
+         field("Pump Flow Gain", "float"),
+         field("Pump Zero Offset", "float"),
+         field("Heater kP", "float"),
+         field("Heater kI", "float"),
+         field("Heater kD", "float"),
+         field("Drip Lag", "float"),
+      }
+   },
+   {
+      name = "Weight Landing",
+      fields = {
+         field("Target", "float"),
+         field("Weight", "float"),
+         field("Error", "float"),
+         field("Drip Lag", "float"),
+      }
+   },
 }
 
 local c2s_messages = {
@@ -62,7 +157,15 @@ local c2s_messages = {
    },
    {
       name = "Settings update",
-      fields = {},
+      fields = {
+         field("Brew Temperature", "float"),
+         field("Steam Temperature", "float"),
+         field("Brew Pressure", "float"),
+         field("Preinfusion Pressure", "float"),
+         field("Preinfusion Time", "float"),
+         field("Brew Weight", "float"),
+         field("Pump Zero", "float"),
+      },
    },
    {
       name = "Get Status",
@@ -74,6 +177,34 @@ local c2s_messages = {
          field("Type", "enum.maintenance_type"),
       }
    },
+   {
+      name = "Manual Control",
+      fields = {
+         field("Target Pressure", "float"),
+         field("Target Flow", "float"),
+         field("Time", "int32"),
+      }
+   },
+   {
+      name = "Get Task Stats",
+      fields = {},
+   },
+   {
+      name = "Get Profile",
+      fields = {
+         field("Stage", "uint32"),
+      }
+   },
+   {
+      name = "Get Transition History",
+      fields = {},
+   },
+   {
+      name = "Brew Profile Update",
+      fields = {
+         field("Phase Count", "uint32"),
+      }
+   },
 }
 
 local data_types = {